@@ -40,6 +40,25 @@
 
 #define PROGRAM_NAME		"minerd"
 #define LP_SCANTIME		60
+#define NSEC_PER_SEC		1000000000ULL
+
+/* Nanoseconds from the monotonic clock. */
+static inline uint64_t mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+struct cpu_topo {
+	int cpu;
+	int core;	/* lowest-numbered SMT sibling */
+	int smt;	/* index among its SMT siblings */
+	int llc;	/* lowest-numbered CPU sharing the last-level cache */
+	int rank;	/* index of its core within the LLC domain */
+	int node;
+};
 
 #ifdef __linux /* Linux specific policy and affinity management */
 #include <sched.h>
@@ -64,6 +83,187 @@ static inline void affine_to_cpu(int id, int cpu)
 	CPU_SET(cpu, &set);
 	sched_setaffinity(0, sizeof(set), &set);
 }
+
+/* Parse a sysfs CPU list such as "0-3,8-11". */
+static bool read_cpu_list(const char *path, cpu_set_t *set)
+{
+	char buf[4096], *p, *end;
+	FILE *f;
+	long a, b;
+
+	CPU_ZERO(set);
+	f = fopen(path, "r");
+	if (!f)
+		return false;
+	p = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	if (!p)
+		return false;
+	while (*p && *p != '\n') {
+		a = b = strtol(p, &end, 10);
+		if (end == p)
+			return false;
+		if (*end == '-') {
+			p = end + 1;
+			b = strtol(p, &end, 10);
+			if (end == p)
+				return false;
+		}
+		for (; a <= b && a < CPU_SETSIZE; a++)
+			CPU_SET(a, set);
+		p = *end == ',' ? end + 1 : end;
+	}
+	return true;
+}
+
+/* Return the first CPU in set, and how many come before cpu. */
+static int cpu_set_first(cpu_set_t *set, int cpu, int *before)
+{
+	int i, first = -1;
+
+	*before = 0;
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (!CPU_ISSET(i, set))
+			continue;
+		if (first < 0)
+			first = i;
+		if (i < cpu)
+			(*before)++;
+	}
+	return first;
+}
+
+/* Number of CPUs the process may run on, or 0 if unknown. */
+static int cpus_allowed(void)
+{
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return 0;
+	return CPU_COUNT(&set);
+}
+
+/* Fill cpus with up to n of the CPUs we may run on; 0 if unknown. */
+static int cpus_allowed_list(int *cpus, int n)
+{
+	cpu_set_t set;
+	int i, k = 0;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return 0;
+	for (i = 0; i < CPU_SETSIZE && k < n; i++) {
+		if (CPU_ISSET(i, &set))
+			cpus[k++] = i;
+	}
+	return k;
+}
+
+/*
+ * Number of CPUs worth of time allowed by the cgroup v2 cpu.max quota
+ * of our cgroup and its ancestors, or 0 if there is no limit.
+ */
+static int cpu_quota(void)
+{
+	char buf[4096], path[4200], max[32], *p, *slash;
+	long long quota, period;
+	FILE *f;
+	int n, cpus = 0;
+
+	f = fopen("/proc/self/cgroup", "r");
+	if (!f)
+		return 0;
+	for (p = NULL; !p && fgets(buf, sizeof(buf), f); ) {
+		if (!strncmp(buf, "0::", 3))
+			p = buf + 3;
+	}
+	fclose(f);
+	if (!p || *p != '/')
+		return 0;
+	p[strcspn(p, "\n")] = '\0';
+
+	for (;;) {
+		snprintf(path, sizeof(path), "/sys/fs/cgroup%s/cpu.max",
+		         strcmp(p, "/") ? p : "");
+		f = fopen(path, "r");
+		if (f) {
+			if (fscanf(f, "%31s %lld", max, &period) == 2 &&
+			    strcmp(max, "max") && period > 0) {
+				quota = strtoll(max, NULL, 10);
+				n = (quota + period / 2) / period;
+				if (n < 1)
+					n = 1;
+				if (!cpus || n < cpus)
+					cpus = n;
+			}
+			fclose(f);
+		}
+		if (!strcmp(p, "/"))
+			break;
+		slash = strrchr(p, '/');
+		if (slash == p)
+			slash++;
+		*slash = '\0';
+	}
+	return cpus;
+}
+
+static int read_topology(struct cpu_topo **topo)
+{
+	const char *sys = "/sys/devices/system/cpu";
+	struct cpu_topo *t;
+	cpu_set_t online, set;
+	char path[128];
+	int cpu, n = 0, i, j, level, best, before;
+
+	if (!read_cpu_list("/sys/devices/system/cpu/online", &online))
+		return 0;
+	/* only place threads where we are allowed to run */
+	if (!sched_getaffinity(0, sizeof(set), &set))
+		CPU_AND(&online, &online, &set);
+	*topo = t = calloc(CPU_COUNT(&online), sizeof(*t));
+	if (!t)
+		return 0;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &online))
+			continue;
+		t[n].cpu = t[n].core = t[n].llc = cpu;
+		sprintf(path, "%s/cpu%d/topology/thread_siblings_list", sys, cpu);
+		if (read_cpu_list(path, &set) && CPU_ISSET(cpu, &set)) {
+			t[n].core = cpu_set_first(&set, cpu, &before);
+			t[n].smt = before;
+		}
+		/* the last-level cache is the highest-level one */
+		for (i = 0, best = 0; ; i++) {
+			FILE *f;
+
+			sprintf(path, "%s/cpu%d/cache/index%d/level", sys, cpu, i);
+			f = fopen(path, "r");
+			if (!f)
+				break;
+			if (fscanf(f, "%d", &level) != 1)
+				level = 0;
+			fclose(f);
+			if (level < best)
+				continue;
+			sprintf(path, "%s/cpu%d/cache/index%d/shared_cpu_list",
+			        sys, cpu, i);
+			if (!read_cpu_list(path, &set) || !CPU_ISSET(cpu, &set))
+				continue;
+			best = level;
+			t[n].llc = cpu_set_first(&set, cpu, &before);
+		}
+		t[n].node = cpu_node(cpu);
+		n++;
+	}
+	for (i = 0; i < n; i++) {
+		for (j = 0; j < n; j++) {
+			if (t[j].llc == t[i].llc && t[j].smt == 0 &&
+			    t[j].core < t[i].core)
+				t[i].rank++;
+		}
+	}
+	return n;
+}
 #elif defined(__FreeBSD__) /* FreeBSD specific policy and affinity management */
 #include <sys/cpuset.h>
 static inline void drop_policy(void)
@@ -77,6 +277,26 @@ static inline void affine_to_cpu(int id, int cpu)
 	CPU_SET(cpu, &set);
 	cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_TID, -1, sizeof(cpuset_t), &set);
 }
+
+static int cpus_allowed(void)
+{
+	return 0;
+}
+
+static int cpus_allowed_list(int *cpus, int n)
+{
+	return 0;
+}
+
+static int cpu_quota(void)
+{
+	return 0;
+}
+
+static int read_topology(struct cpu_topo **topo)
+{
+	return 0;
+}
 #else
 static inline void drop_policy(void)
 {
@@ -85,11 +305,34 @@ static inline void drop_policy(void)
 static inline void affine_to_cpu(int id, int cpu)
 {
 }
+
+static int cpus_allowed(void)
+{
+	return 0;
+}
+
+static int cpus_allowed_list(int *cpus, int n)
+{
+	return 0;
+}
+
+static int cpu_quota(void)
+{
+	return 0;
+}
+
+static int read_topology(struct cpu_topo **topo)
+{
+	return 0;
+}
 #endif
 		
 enum workio_commands {
 	WC_GET_WORK,
 	WC_SUBMIT_WORK,
+	WC_PREFETCH,
+	WC_SUBMIT_SHARE,
+	WC_QUIT,
 };
 
 struct workio_cmd {
@@ -97,6 +340,7 @@ struct workio_cmd {
 	struct thr_info		*thr;
 	union {
 		struct work	*work;
+		struct share	*share;
 	} u;
 };
 
@@ -112,6 +356,20 @@ static const char *algo_names[] = {
 	[ALGO_M7M]			= "m7mhash",
 };
 
+enum placements {
+	PLACE_SPREAD,		/* one thread per core, spread over LLC domains */
+	PLACE_CORES,		/* one thread per core, one LLC domain at a time */
+	PLACE_COMPACT,		/* fill every SMT sibling of a core first */
+	PLACE_NONE,
+};
+
+static const char *placement_names[] = {
+	[PLACE_SPREAD]		= "spread",
+	[PLACE_CORES]		= "cores",
+	[PLACE_COMPACT]		= "compact",
+	[PLACE_NONE]		= "none",
+};
+
 bool opt_debug = false;
 bool opt_protocol = false;
 static bool opt_benchmark = false;
@@ -129,11 +387,21 @@ static int opt_retries = -1;
 static int opt_fail_pause = 30;
 int opt_timeout = 0;
 static int opt_scantime = 5;
+static int opt_prefetch = 1;
+static int opt_switch_latency = 250;
 static const bool opt_time = true;
 static enum algos opt_algo = ALGO_M7M;
 static int opt_scrypt_n = 1024;
+int opt_scrypt_tmto = 0;
+static bool opt_scrypt_tune = true;
 static int opt_n_threads;
 static int num_processors;
+static enum placements opt_placement = PLACE_SPREAD;
+static int *thr_cpu;
+static bool auto_threads = false;
+static int active_threads;	/* miner threads allowed to hash */
+static pthread_mutex_t park_lock;
+static pthread_cond_t park_cond;
 static char *rpc_url;
 static char *rpc_userpass;
 static char *rpc_user, *rpc_pass;
@@ -147,15 +415,44 @@ struct thr_info *thr_info;
 static int work_thr_id;
 int longpoll_thr_id = -1;
 int stratum_thr_id = -1;
+static int prep_thr_id = -1;
 struct work_restart *work_restart = NULL;
 static struct stratum_ctx stratum;
 
 pthread_mutex_t applog_lock;
-static pthread_mutex_t stats_lock;
 
+#define SWITCH_BUCKETS		24
+
+/*
+ * Per-thread statistics, one cache line each.  The scan counters are
+ * only written by the miner thread itself, inside a sequence lock so
+ * that readers get a consistent snapshot without ever blocking it.
+ * Share results are added by the threads submitting the shares.
+ */
+struct thr_stats {
+	unsigned long seq;	/* odd while the miner is updating */
+	uint64_t hashes;
+	uint64_t scan_us;	/* total time spent scanning */
+	double hashrate;	/* hashes per second over the last scan */
+	uint64_t found;		/* solutions found */
+	uint64_t accepted;
+	uint64_t rejected;
+	uint64_t stale;		/* solutions dropped before submission */
+} __attribute__((aligned(64)));
+
+/*
+ * Time from publication of a job to its first hash, per thread, in
+ * power-of-two buckets: [2^k, 2^(k+1)) microseconds.  Kept apart so
+ * that the counters above stay on a single cache line.
+ */
+struct switch_stats {
+	uint64_t hist[SWITCH_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct thr_stats *thr_stats;
+static struct switch_stats *switch_stats;
 static unsigned long accepted_count = 0L;
 static unsigned long rejected_count = 0L;
-static double *thr_hashrates;
 
 #ifdef HAVE_GETOPT_LONG
 #include <getopt.h>
@@ -175,19 +472,29 @@ Options:\n\
                           scrypt    scrypt(1024, 1, 1) (default)\n\
                           scrypt:N  scrypt(N, 1, 1)\n\
                           sha256d   SHA-256d\n\
+      --scrypt-tmto=K   store only every K-th scratchpad entry and recompute\n\
+                          the others (K a power of 2, or auto; default: off)\n\
+      --no-scrypt-tune  do not calibrate the scrypt kernel at startup\n\
   -o, --url=URL         URL of mining server\n\
   -O, --userpass=U:P    username:password pair for mining server\n\
   -u, --user=USERNAME   username for mining server\n\
   -p, --pass=PASSWORD   password for mining server\n\
       --cert=FILE       certificate for mining server using SSL\n\
   -x, --proxy=[PROTOCOL://]HOST[:PORT]  connect through a proxy\n\
-  -t, --threads=N       number of miner threads (default: number of processors)\n\
+  -t, --threads=N       number of miner threads (default: number of processors\n\
+                          available, limited by the CPU quota)\n\
+      --placement=POLICY  how to bind miner threads to CPUs:\n\
+                          spread, cores, compact or none (default: spread)\n\
   -r, --retries=N       number of times to retry if a network call fails\n\
                           (default: retry indefinitely)\n\
   -R, --retry-pause=N   time to pause between retries, in seconds (default: 30)\n\
   -T, --timeout=N       timeout for long polling, in seconds (default: none)\n\
+      --prefetch=N      number of work units to fetch ahead of time when not\n\
+                          using Stratum (default: 1)\n\
   -s, --scantime=N      upper bound on time spent scanning current work when\n\
                           long polling is unavailable, in seconds (default: 5)\n\
+      --switch-latency=N  upper bound on the time spent hashing an outdated job,\n\
+                          in milliseconds (default: 250)\n\
       --coinbase-addr=ADDR  payout address for solo mining\n\
       --coinbase-sig=TEXT  data to insert in the coinbase when possible\n\
       --no-longpoll     disable long polling support\n\
@@ -238,14 +545,19 @@ static struct option const options[] = {
 	{ "no-getwork", 0, NULL, 1010 },
 	{ "no-longpoll", 0, NULL, 1003 },
 	{ "no-redirect", 0, NULL, 1009 },
+	{ "no-scrypt-tune", 0, NULL, 1019 },
 	{ "no-stratum", 0, NULL, 1007 },
 	{ "pass", 1, NULL, 'p' },
+	{ "placement", 1, NULL, 1021 },
+	{ "prefetch", 1, NULL, 1025 },
 	{ "protocol-dump", 0, NULL, 'P' },
 	{ "proxy", 1, NULL, 'x' },
 	{ "quiet", 0, NULL, 'q' },
 	{ "retries", 1, NULL, 'r' },
 	{ "retry-pause", 1, NULL, 'R' },
 	{ "scantime", 1, NULL, 's' },
+	{ "scrypt-tmto", 1, NULL, 1017 },
+	{ "switch-latency", 1, NULL, 1023 },
 #ifdef HAVE_SYSLOG_H
 	{ "syslog", 0, NULL, 'S' },
 #endif
@@ -258,12 +570,22 @@ static struct option const options[] = {
 	{ 0, 0, 0, 0 }
 };
 
+/*
+ * Hex of the transaction count and transactions that follow the header
+ * in a block built from a template; shared by all copies of a work.
+ */
+struct txs_blob {
+	int refcnt;
+	size_t len;
+	char hex[];
+};
+
 struct work {
 	uint32_t data[32];
 	uint32_t target[8];
 
 	int height;
-	char *txs;
+	struct txs_blob *txs;
 	char *workid;
 
 	char *job_id;
@@ -272,14 +594,138 @@ struct work {
 };
 
 static struct work g_work;
-static time_t g_work_time;
+static uint64_t g_work_time;	/* mono_ns() when g_work was fetched */
 static pthread_mutex_t g_work_lock;
+
+/* The nonces a miner has claimed in a job, on a cache line of their own. */
+struct nonce_range {
+	uint64_t range;		/* end << 32 | next, owned by one miner */
+	char pad[56];
+};
+
+/*
+ * Immutable snapshots of g_work, handed to the miner threads without
+ * locking.  Writers update g_work under g_work_lock and then publish a
+ * snapshot; miners notice a new one by comparing g_job_epoch and take a
+ * reference.  Slots are never freed, so a reader racing with a slot
+ * being recycled only ever touches a valid refcount.
+ */
+struct job {
+	struct work work;
+	unsigned long epoch;
+	int refcnt;
+	int free;
+	uint64_t publish_ns;	/* mono_ns() when the job was published */
+	uint64_t next_nonce;	/* start of the unclaimed nonce space */
+	struct nonce_range *ranges;
+
+	/* Stratum only: what miners need to build their own headers */
+	unsigned char *coinbase;
+	size_t coinbase_size, coinbase_alloc;
+	size_t xnonce2_offset;
+	size_t coinbase_prefix;	/* whole blocks before extranonce2 */
+	uint32_t coinbase_midstate[8];
+	unsigned char (*merkle)[32];
+	int merkle_count, merkle_alloc;
+};
+
+static struct job *jobs;
+static int num_jobs;
+static struct job *g_job;
+static unsigned long g_job_epoch;
+
+/*
+ * Preallocated share submissions, SHARE_SLOTS per miner thread.  A share
+ * keeps a reference to its job instead of copying the work; only the
+ * owning miner sets busy, and the workio thread clears it once the share
+ * has been submitted.
+ */
+#define SHARE_SLOTS		4
+#define SHARE_XNONCE2_MAX	32
+
+struct share {
+	struct workio_cmd wc;
+	int busy;
+	struct job *job;
+	uint32_t data[32];
+	size_t xnonce2_len;
+	unsigned char xnonce2[SHARE_XNONCE2_MAX];
+} __attribute__((aligned(64)));
+
+static struct share *shares;
+
+/*
+ * Stratum headers prepared ahead of time by prep_thread, one ring per
+ * miner.  Only the producer advances tail; head is advanced with a CAS
+ * both by the miner popping a header and by the producer dropping
+ * headers of an older job.  A miner that finds its ring empty sleeps on
+ * the ring's condition until the producer fills it.
+ */
+#define PREP_DEPTH		4
+#define PREP_XNONCE2_MAX	16
+#define PREP_BATCH		8
+#define PREP_WAIT_MS		100	/* to recheck for a new job or a restart */
+
+struct prep_header {
+	unsigned long epoch;
+	uint32_t merkle_root[8];
+	unsigned char xnonce2[PREP_XNONCE2_MAX];
+};
+
+struct prep_ring {
+	unsigned long head;
+	unsigned long tail;
+	int waiting;		/* the miner sleeps on cond */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct prep_header slot[PREP_DEPTH];
+} __attribute__((aligned(64)));
+
+static struct prep_ring *prep_rings;
+static pthread_mutex_t prep_lock;
+static pthread_cond_t prep_cond;
+static bool prep_wanted;
+
+static void prep_wake(void)
+{
+	if (!prep_rings)
+		return;
+	pthread_mutex_lock(&prep_lock);
+	prep_wanted = true;
+	pthread_cond_signal(&prep_cond);
+	pthread_mutex_unlock(&prep_lock);
+}
+
 static bool submit_old = false;
 static char *lp_id;
+static pthread_mutex_t lp_id_lock;	/* lp_id and enabling GBT longpoll */
+
+/* Allocate a zeroed array starting on a cache line; it is never freed. */
+static void *calloc_aligned(size_t nmemb, size_t size)
+{
+	unsigned char *p = calloc(nmemb * size + 63, 1);
+
+	if (!p)
+		return NULL;
+	return (void *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+}
+
+static inline struct txs_blob *txs_get(struct txs_blob *txs)
+{
+	if (txs)
+		__atomic_add_fetch(&txs->refcnt, 1, __ATOMIC_RELAXED);
+	return txs;
+}
+
+static inline void txs_put(struct txs_blob *txs)
+{
+	if (txs && !__atomic_sub_fetch(&txs->refcnt, 1, __ATOMIC_ACQ_REL))
+		free(txs);
+}
 
 static inline void work_free(struct work *w)
 {
-	free(w->txs);
+	txs_put(w->txs);
 	free(w->workid);
 	free(w->job_id);
 	free(w->xnonce2);
@@ -288,8 +734,7 @@ static inline void work_free(struct work *w)
 static inline void work_copy(struct work *dest, const struct work *src)
 {
 	memcpy(dest, src, sizeof(struct work));
-	if (src->txs)
-		dest->txs = strdup(src->txs);
+	txs_get(src->txs);
 	if (src->workid)
 		dest->workid = strdup(src->workid);
 	if (src->job_id)
@@ -300,6 +745,224 @@ static inline void work_copy(struct work *dest, const struct work *src)
 	}
 }
 
+static void job_put(struct job *job)
+{
+	if (!job)
+		return;
+	if (__atomic_sub_fetch(&job->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+		work_free(&job->work);
+		__atomic_store_n(&job->free, 1, __ATOMIC_RELEASE);
+	}
+}
+
+static struct job *job_get(void)
+{
+	struct job *job;
+	int ref;
+
+	for (;;) {
+		job = __atomic_load_n(&g_job, __ATOMIC_ACQUIRE);
+		if (!job)
+			return NULL;
+		ref = __atomic_load_n(&job->refcnt, __ATOMIC_RELAXED);
+		while (ref > 0 &&
+		       !__atomic_compare_exchange_n(&job->refcnt, &ref, ref + 1,
+		                                    true, __ATOMIC_ACQUIRE,
+		                                    __ATOMIC_RELAXED));
+		if (ref <= 0)
+			continue;
+		/* the slot may have been recycled before we got our reference */
+		if (__atomic_load_n(&g_job, __ATOMIC_ACQUIRE) == job)
+			return job;
+		job_put(job);
+	}
+}
+
+/* Copy the current stratum job, which g_work was generated from. */
+static void job_copy_stratum(struct job *job, struct stratum_ctx *sctx)
+{
+	size_t off;
+	int i;
+
+	pthread_mutex_lock(&sctx->work_lock);
+	if (job->coinbase_alloc < sctx->job.coinbase_size) {
+		free(job->coinbase);
+		job->coinbase = malloc(sctx->job.coinbase_size);
+		job->coinbase_alloc = job->coinbase ? sctx->job.coinbase_size : 0;
+	}
+	if (job->merkle_alloc < sctx->job.merkle_count) {
+		free(job->merkle);
+		job->merkle = malloc(sctx->job.merkle_count * sizeof(*job->merkle));
+		job->merkle_alloc = job->merkle ? sctx->job.merkle_count : 0;
+	}
+	if (job->coinbase_alloc < sctx->job.coinbase_size ||
+	    job->merkle_alloc < sctx->job.merkle_count) {
+		job->coinbase_size = 0;
+		goto out;
+	}
+	job->coinbase_size = sctx->job.coinbase_size;
+	memcpy(job->coinbase, sctx->job.coinbase, job->coinbase_size);
+	job->xnonce2_offset = sctx->job.xnonce2 - sctx->job.coinbase;
+	job->merkle_count = sctx->job.merkle_count;
+	for (i = 0; i < job->merkle_count; i++)
+		memcpy(job->merkle[i], sctx->job.merkle[i], 32);
+out:
+	pthread_mutex_unlock(&sctx->work_lock);
+
+	if (!job->coinbase_size)
+		return;
+	/* the blocks before extranonce2 are the same for every header */
+	job->coinbase_prefix = job->xnonce2_offset & ~(size_t)63;
+	sha256_init(job->coinbase_midstate);
+	for (off = 0; off < job->coinbase_prefix; off += 64)
+		sha256_transform(job->coinbase_midstate,
+		                 (uint32_t *)(job->coinbase + off), 1);
+}
+
+/* Publish a snapshot of g_work; g_work_lock must be held. */
+static void publish_work(void)
+{
+	struct job *job = NULL, *old;
+	int i;
+
+	while (!job) {
+		for (i = 0; i < num_jobs; i++) {
+			if (__atomic_load_n(&jobs[i].free, __ATOMIC_ACQUIRE)) {
+				job = &jobs[i];
+				break;
+			}
+		}
+		/*
+		 * slots are held by the miners, their pending shares,
+		 * prep_thread and g_job; num_jobs leaves one free for us
+		 */
+		if (!job)
+			sched_yield();
+	}
+	job->free = 0;
+	work_copy(&job->work, &g_work);
+	job->epoch = g_job_epoch + 1;
+	job->publish_ns = mono_ns();
+	job->next_nonce = 0;
+	for (i = 0; i < opt_n_threads; i++)
+		job->ranges[i].range = 0;
+	job->coinbase_size = 0;
+	if (have_stratum && g_work.job_id)
+		job_copy_stratum(job, &stratum);
+	__atomic_store_n(&job->refcnt, 1, __ATOMIC_RELAXED);
+
+	old = g_job;
+	__atomic_store_n(&g_job, job, __ATOMIC_RELEASE);
+	__atomic_store_n(&g_job_epoch, job->epoch, __ATOMIC_RELEASE);
+	job_put(old);
+	if (job->coinbase_size)
+		prep_wake();
+}
+
+/*
+ * Each job's nonce space is handed out in chunks sized to the hashrate of
+ * the claiming thread.  A thread scans its chunk a slice at a time from
+ * the front, and a thread that finds nothing left to claim steals the
+ * back half of the largest remaining chunk.  Sizes are kept multiples of
+ * every scanhash batch width so that batches never run past a range.
+ */
+#define NONCE_END	(0xffffffffU - 0x20)
+#define NONCE_ALIGN	48
+
+static inline uint64_t nonce_range(uint32_t next, uint32_t end)
+{
+	return (uint64_t)end << 32 | next;
+}
+
+static bool nonce_take(struct job *job, int thr_id, uint32_t size,
+	uint32_t *start, uint32_t *end)
+{
+	uint64_t *range = &job->ranges[thr_id].range;
+	uint64_t r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+	uint32_t next, last;
+
+	do {
+		next = (uint32_t)r;
+		last = r >> 32;
+		if (next >= last)
+			return false;
+		if (size > last - next)
+			size = last - next;
+	} while (!__atomic_compare_exchange_n(range, &r,
+	                                      nonce_range(next + size, last), true,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	*start = next;
+	*end = next + size;
+	return true;
+}
+
+/* Put back the unscanned part of the last slice taken. */
+static void nonce_untake(struct job *job, int thr_id, uint32_t start,
+	uint32_t end)
+{
+	uint64_t *range = &job->ranges[thr_id].range;
+	uint64_t r = __atomic_load_n(range, __ATOMIC_ACQUIRE);
+
+	do {
+		if ((uint32_t)r != end || start >= end)
+			return;
+	} while (!__atomic_compare_exchange_n(range, &r,
+	                                      nonce_range(start, r >> 32), true,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
+
+static bool nonce_claim(struct job *job, int thr_id, uint32_t size)
+{
+	uint64_t start, end;
+
+	start = __atomic_fetch_add(&job->next_nonce, size, __ATOMIC_RELAXED);
+	if (start >= NONCE_END)
+		return false;
+	end = start + size < NONCE_END ? start + size : NONCE_END;
+	__atomic_store_n(&job->ranges[thr_id].range, nonce_range(start, end),
+	                 __ATOMIC_RELEASE);
+	return true;
+}
+
+static bool nonce_steal(struct job *job, int thr_id)
+{
+	uint64_t r, best_r;
+	uint32_t next, last, left, best_left, mid;
+	int i, best;
+
+	do {
+		best = -1;
+		best_left = 0;
+		best_r = 0;
+		for (i = 0; i < opt_n_threads; i++) {
+			if (i == thr_id)
+				continue;
+			r = __atomic_load_n(&job->ranges[i].range, __ATOMIC_ACQUIRE);
+			next = (uint32_t)r;
+			last = r >> 32;
+			left = last > next ? last - next : 0;
+			if (left > best_left) {
+				best = i;
+				best_left = left;
+				best_r = r;
+			}
+		}
+		if (best_left < 2 * NONCE_ALIGN)
+			return false;
+		next = (uint32_t)best_r;
+		last = best_r >> 32;
+		mid = last - best_left / 2 / NONCE_ALIGN * NONCE_ALIGN;
+	} while (!__atomic_compare_exchange_n(&job->ranges[best].range, &best_r,
+	                                      nonce_range(next, mid), false,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+	__atomic_store_n(&job->ranges[thr_id].range, nonce_range(mid, last),
+	                 __ATOMIC_RELEASE);
+	if (opt_debug)
+		applog(LOG_DEBUG, "DEBUG: thread %d stole %u nonces from thread %d",
+		       thr_id, last - mid, best);
+	return true;
+}
+
 static bool jobj_binary(const json_t *obj, const char *key,
 			void *buf, size_t buflen)
 {
@@ -352,6 +1015,82 @@ err_out:
 	return false;
 }
 
+/*
+ * Transactions of large templates are decoded and hashed by up to
+ * TX_HASH_THREADS threads, which claim TX_HASH_CHUNK of them at a time.
+ */
+#define TX_HASH_THREADS	8
+#define TX_HASH_CHUNK	16
+#define TX_HASH_MIN	256	/* transactions per thread */
+
+struct tx_hex {
+	const char *hex;
+	size_t len;
+};
+
+struct tx_hash_ctx {
+	const struct tx_hex *txs;
+	unsigned char (*hash)[32];
+	int count;
+	int next;
+	int failed;
+};
+
+static void *tx_hash_thread(void *userdata)
+{
+	struct tx_hash_ctx *ctx = userdata;
+	unsigned char *buf = NULL;
+	size_t buf_size = 0;
+	int i, end;
+
+	while (!__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED)) {
+		i = __atomic_fetch_add(&ctx->next, TX_HASH_CHUNK, __ATOMIC_RELAXED);
+		if (i >= ctx->count)
+			break;
+		end = i + TX_HASH_CHUNK < ctx->count ? i + TX_HASH_CHUNK : ctx->count;
+		for (; i < end; i++) {
+			size_t size = ctx->txs[i].len / 2;
+			if (size > buf_size) {
+				free(buf);
+				buf_size = 2 * size;
+				buf = malloc(buf_size);
+			}
+			if (!buf || !hex2bin_len(buf, ctx->txs[i].hex, ctx->txs[i].len)) {
+				__atomic_store_n(&ctx->failed, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			sha256d(ctx->hash[i], buf, size);
+		}
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/* Compute the hashes of count transactions into hash. */
+static bool tx_hash_all(const struct tx_hex *txs, int count,
+			unsigned char (*hash)[32])
+{
+	struct tx_hash_ctx ctx = { txs, hash, count, 0, 0 };
+	pthread_t thr[TX_HASH_THREADS - 1];
+	int i, n;
+
+	n = count / TX_HASH_MIN;
+	if (n > num_processors)
+		n = num_processors;
+	if (n > TX_HASH_THREADS)
+		n = TX_HASH_THREADS;
+	for (i = 0; i < n - 1; i++)
+		if (pthread_create(&thr[i], NULL, tx_hash_thread, &ctx))
+			break;
+	n = i;
+	tx_hash_thread(&ctx);
+	for (i = 0; i < n; i++)
+		pthread_join(thr[i], NULL);
+
+	return !ctx.failed;
+}
+
 static bool gbt_work_decode(const json_t *val, struct work *work)
 {
 	int i, n;
@@ -361,6 +1100,10 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	int cbtx_size;
 	unsigned char *cbtx = NULL;
 	int tx_count, tx_size;
+	struct tx_hex *txh = NULL;
+	struct txs_blob *txs;
+	char *p;
+	uint32_t midstate[8];
 	unsigned char txc_vi[9];
 	unsigned char (*merkle_tree)[32] = NULL;
 	bool coinbase_append = false;
@@ -434,6 +1177,9 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		goto out;
 	}
 	tx_count = json_array_size(txa);
+	txh = malloc((tx_count + 1) * sizeof(*txh));
+	if (!txh)
+		goto out;
 	tx_size = 0;
 	for (i = 0; i < tx_count; i++) {
 		const json_t *tx = json_array_get(txa, i);
@@ -442,7 +1188,9 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 			applog(LOG_ERR, "JSON invalid transactions");
 			goto out;
 		}
-		tx_size += strlen(tx_hex) / 2;
+		txh[i].hex = tx_hex;
+		txh[i].len = strlen(tx_hex);
+		tx_size += txh[i].len / 2;
 	}
 
 	/* build coinbase transaction */
@@ -541,28 +1289,41 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 		}
 	}
 
-	n = varint_encode(txc_vi, 1 + tx_count);
-	work->txs = malloc(2 * (n + cbtx_size + tx_size) + 1);
-	bin2hex(work->txs, txc_vi, n);
-	bin2hex(work->txs + 2*n, cbtx, cbtx_size);
-
 	/* generate merkle root */
 	merkle_tree = malloc(32 * ((1 + tx_count + 1) & ~1));
+	if (!merkle_tree)
+		goto out;
 	sha256d(merkle_tree[0], cbtx, cbtx_size);
-	for (i = 0; i < tx_count; i++) {
-		tmp = json_array_get(txa, i);
-		const char *tx_hex = json_string_value(json_object_get(tmp, "data"));
-		const int tx_size = tx_hex ? strlen(tx_hex) / 2 : 0;
-		unsigned char *tx = malloc(tx_size);
-		if (!tx_hex || !hex2bin(tx, tx_hex, tx_size)) {
-			applog(LOG_ERR, "JSON invalid transactions");
-			free(tx);
-			goto out;
+	if (!tx_hash_all(txh, tx_count, merkle_tree + 1)) {
+		applog(LOG_ERR, "JSON invalid transactions");
+		goto out;
+	}
+
+	/* block data after the header, appended at a cursor */
+	n = varint_encode(txc_vi, 1 + tx_count);
+	txs = malloc(sizeof(*txs) + 2 * (n + cbtx_size) + 1 +
+	             (submit_coinbase ? 0 : 2 * (size_t)tx_size));
+	if (!txs)
+		goto out;
+	txs->refcnt = 1;
+	p = txs->hex;
+	bin2hex(p, txc_vi, n);
+	p += 2 * n;
+	bin2hex(p, cbtx, cbtx_size);
+	p += 2 * cbtx_size;
+	if (!submit_coinbase) {
+		for (i = 0; i < tx_count; i++) {
+			memcpy(p, txh[i].hex, txh[i].len);
+			p += txh[i].len;
 		}
-		sha256d(merkle_tree[1 + i], tx, tx_size);
-		if (!submit_coinbase)
-			strcat(work->txs, tx_hex);
 	}
+	*p = '\0';
+	txs->len = p - txs->hex;
+	txs_put(work->txs);
+	work->txs = txs;
+
+	/* each level hashes pairs of adjacent nodes, several at a time */
+	sha256_init(midstate);
 	n = 1 + tx_count;
 	while (n > 1) {
 		if (n % 2) {
@@ -570,8 +1331,8 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 			++n;
 		}
 		n /= 2;
-		for (i = 0; i < n; i++)
-			sha256d(merkle_tree[i], merkle_tree[2*i], 64);
+		sha256d_resume_multi(merkle_tree[0], midstate, merkle_tree[0],
+		                     64, 64, n);
 	}
 
 	/* assemble block header */
@@ -605,6 +1366,8 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 	/* Long polling */
 	tmp = json_object_get(val, "longpollid");
 	if (want_longpoll && json_is_string(tmp)) {
+		/* both the workio and the longpoll threads decode templates */
+		pthread_mutex_lock(&lp_id_lock);
 		free(lp_id);
 		lp_id = strdup(json_string_value(tmp));
 		if (!have_longpoll) {
@@ -614,34 +1377,153 @@ static bool gbt_work_decode(const json_t *val, struct work *work)
 			have_longpoll = true;
 			tq_push(thr_info[longpoll_thr_id].q, lp_uri);
 		}
+		pthread_mutex_unlock(&lp_id_lock);
 	}
 
 	rc = true;
 
 out:
+	free(txh);
 	free(cbtx);
 	free(merkle_tree);
 	return rc;
 }
 
-static void share_result(int result, const char *reason)
+/* Account for a scan; only ever called by the miner thread itself. */
+static void stats_scan(int thr_id, uint64_t hashes, uint64_t us,
+	double hashrate, bool found)
 {
-	char s[345];
-	double hashrate;
+	struct thr_stats *st = &thr_stats[thr_id];
+	unsigned long seq = st->seq;
+
+	__atomic_store_n(&st->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&st->hashes, st->hashes + hashes, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->scan_us, st->scan_us + us, __ATOMIC_RELAXED);
+	__atomic_store(&st->hashrate, &hashrate, __ATOMIC_RELAXED);
+	if (found)
+		__atomic_store_n(&st->found, st->found + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* Take a consistent copy of the statistics of a thread. */
+static void stats_snapshot(int thr_id, struct thr_stats *out)
+{
+	struct thr_stats *st = &thr_stats[thr_id];
+	unsigned long seq;
+
+	do {
+		while ((seq = __atomic_load_n(&st->seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		out->hashes = __atomic_load_n(&st->hashes, __ATOMIC_RELAXED);
+		out->scan_us = __atomic_load_n(&st->scan_us, __ATOMIC_RELAXED);
+		__atomic_load(&st->hashrate, &out->hashrate, __ATOMIC_RELAXED);
+		out->found = __atomic_load_n(&st->found, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&st->seq, __ATOMIC_RELAXED) != seq);
+	out->seq = seq;
+	out->accepted = __atomic_load_n(&st->accepted, __ATOMIC_RELAXED);
+	out->rejected = __atomic_load_n(&st->rejected, __ATOMIC_RELAXED);
+	out->stale = __atomic_load_n(&st->stale, __ATOMIC_RELAXED);
+}
+
+/* Account for the time a thread took to start hashing a new job. */
+static void stats_switch(int thr_id, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	int k;
+
+	for (k = 0; us > 1 && k < SWITCH_BUCKETS - 1; k++)
+		us >>= 1;
+	__atomic_add_fetch(&switch_stats[thr_id].hist[k], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Report the distribution of job switch latencies over all threads,
+ * bucket by bucket, along with the hashmeter; at most once every
+ * SWITCH_REPORT_SECS and only if there were new switches.
+ */
+#define SWITCH_REPORT_SECS	60
+
+static void switch_report(uint64_t now)
+{
+	static uint64_t last_report, last_total;
+	uint64_t hist[SWITCH_BUCKETS] = {0}, total = 0, n;
+	int i, k, len, p50 = -1, p99 = -1, max = 0;
+	char s[SWITCH_BUCKETS * 48];
+
+	if (now - last_report < SWITCH_REPORT_SECS * NSEC_PER_SEC)
+		return;
+	last_report = now;
+
+	for (i = 0; i < opt_n_threads; i++) {
+		for (k = 0; k < SWITCH_BUCKETS; k++) {
+			n = __atomic_load_n(&switch_stats[i].hist[k], __ATOMIC_RELAXED);
+			hist[k] += n;
+			total += n;
+		}
+	}
+	if (total == last_total)
+		return;
+	last_total = total;
+
+	for (k = 0, n = 0, len = 0; k < SWITCH_BUCKETS; k++) {
+		n += hist[k];
+		if (p50 < 0 && 2 * n >= total)
+			p50 = k;
+		if (p99 < 0 && 100 * n >= 99 * total)
+			p99 = k;
+		if (hist[k]) {
+			max = k;
+			len += sprintf(s + len, "%s< %lu us: %llu", len ? ", " : "",
+			               2UL << k, (unsigned long long)hist[k]);
+		}
+	}
+	applog(LOG_INFO, "job switch latency over %llu switches: "
+	       "50%% < %lu us, 99%% < %lu us, max < %lu us",
+	       (unsigned long long)total, 2UL << p50, 2UL << p99, 2UL << max);
+	applog(LOG_INFO, "job switch latency histogram: %s", s);
+}
+
+/* Sum of the current hashrates of the first n threads. */
+static double stats_hashrate(int n)
+{
+	struct thr_stats st;
+	double hashrate = 0.;
 	int i;
 
-	hashrate = 0.;
-	pthread_mutex_lock(&stats_lock);
-	for (i = 0; i < opt_n_threads; i++)
-		hashrate += thr_hashrates[i];
-	result ? accepted_count++ : rejected_count++;
-	pthread_mutex_unlock(&stats_lock);
+	for (i = 0; i < n; i++) {
+		stats_snapshot(i, &st);
+		hashrate += st.hashrate;
+	}
+	return hashrate;
+}
+
+/* Record the result of a share submitted by thread thr_id, if known. */
+static void share_result(int result, const char *reason, int thr_id)
+{
+	char s[345];
+	double hashrate;
+	unsigned long accepted, rejected;
+
+	if (thr_id >= 0 && thr_id < opt_n_threads)
+		__atomic_add_fetch(result ? &thr_stats[thr_id].accepted
+		                          : &thr_stats[thr_id].rejected,
+		                   1, __ATOMIC_RELAXED);
+	if (result) {
+		accepted = __atomic_add_fetch(&accepted_count, 1, __ATOMIC_RELAXED);
+		rejected = __atomic_load_n(&rejected_count, __ATOMIC_RELAXED);
+	} else {
+		accepted = __atomic_load_n(&accepted_count, __ATOMIC_RELAXED);
+		rejected = __atomic_add_fetch(&rejected_count, 1, __ATOMIC_RELAXED);
+	}
+	hashrate = stats_hashrate(opt_n_threads);
 	
 	sprintf(s, hashrate >= 1e6 ? "%.0f" : "%.2f", 1e-3 * hashrate);
 	applog(LOG_INFO, "accepted: %lu/%lu (%.2f%%), %s khash/s %s",
-		   accepted_count,
-		   accepted_count + rejected_count,
-		   100. * accepted_count / (accepted_count + rejected_count),
+		   accepted,
+		   accepted + rejected,
+		   100. * accepted / (accepted + rejected),
 		   s,
 		   result ? "(yay!!!)" : "(booooo)");
 
@@ -649,19 +1531,62 @@ static void share_result(int result, const char *reason)
 		applog(LOG_DEBUG, "DEBUG: reject reason: %s", reason);
 }
 
-static bool submit_upstream_work(CURL *curl, struct work *work)
+/* Responses to share submissions carry the id of the submitting thread. */
+#define STRATUM_SUBMIT_ID	4
+
+/*
+ * The workio thread runs its JSON-RPC requests concurrently, on a few
+ * persistent curl handles driven by a multi handle.  Pending requests
+ * are started by priority; the last free handle is kept for blocks, and
+ * shares leave one more to work fetches, so that neither waits behind
+ * slow share submissions.
+ */
+#define WORKIO_HANDLES	4
+#define WORKIO_POLL_MS	10	/* bounds the delay to pick up new commands */
+
+enum workio_prio {
+	WP_BLOCK,
+	WP_SHARE,
+	WP_FETCH,
+	WP_PREFETCH,
+};
+
+struct workio_req {
+	struct workio_req	*next;
+	struct workio_cmd	*wc;
+	int			prio;
+	int			failures;
+	uint64_t		not_before;	/* when a failed request may be retried */
+	uint64_t		start;
+	struct rpc_req		*rpc;		/* while in flight */
+	bool			gbt;		/* asked for a block template */
+	unsigned long		gen;		/* prefetch_gen when sent */
+	struct work		work;
+	struct rpc_iov		iov[3];
+	int			iovcnt;
+	char			*tail;
+	char			head[345];
+};
+
+/*
+ * Start submitting the work in r: stale work is dropped and Stratum
+ * shares are sent right away, other work is encoded into r->iov.
+ * Returns 1 if the request must be sent, 0 if done and -1 on failure.
+ */
+static int submit_upstream_begin(struct workio_req *r, int thr_id)
 {
-	json_t *val, *res, *reason;
+	struct work *work = &r->work;
+	json_t *val;
 	char data_str[2 * sizeof(work->data) + 1];
-	char s[345];
+	char *s = r->head;
 	int i;
-	bool rc = false;
 
 	/* pass if the previous hash is not the current previous hash */
 	if (!submit_old && memcmp(work->data + 1, g_work.data + 1, 32)) {
 		if (opt_debug)
 			applog(LOG_DEBUG, "DEBUG: stale work detected, discarding");
-		return true;
+		__atomic_add_fetch(&thr_stats[thr_id].stale, 1, __ATOMIC_RELAXED);
+		return 0;
 	}
 
 	if (have_stratum) {
@@ -675,8 +1600,9 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
 			xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
 			sprintf(s,
-				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-				rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
+				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%d}",
+				rpc_user, work->job_id, xnonce2str, ntimestr, noncestr,
+				STRATUM_SUBMIT_ID + thr_id);
 			free(xnonce2str);
 		} else {
 			uint32_t ntime, nonce;
@@ -688,46 +1614,78 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 			bin2hex(noncestr, (const unsigned char *)(&nonce), 4);
 			xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
 			sprintf(s,
-				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":4}",
-				rpc_user, work->job_id, xnonce2str, ntimestr, noncestr);
+				"{\"method\": \"mining.submit\", \"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\":%d}",
+				rpc_user, work->job_id, xnonce2str, ntimestr, noncestr,
+				STRATUM_SUBMIT_ID + thr_id);
 			free(xnonce2str);
 		}
 
 		if (unlikely(!stratum_send_line(&stratum, s))) {
 			applog(LOG_ERR, "submit_upstream_work stratum_send_line failed");
-			goto out;
+			return -1;
 		}
-	} else if (work->txs) {
-		char *req;
+		return 0;
+	}
 
+	if (work->txs) {
 		for (i = 0; i < ARRAY_SIZE(work->data); i++)
 			be32enc(work->data + i, work->data[i]);
-		bin2hex(data_str, (unsigned char *)work->data, 80);
+		sprintf(s, "{\"method\": \"submitblock\", \"params\": [\"");
+		bin2hex(s + strlen(s), (unsigned char *)work->data, 80);
+		free(r->tail);
+		r->tail = NULL;
 		if (work->workid) {
 			char *params;
 			val = json_object();
 			json_object_set_new(val, "workid", json_string(work->workid));
 			params = json_dumps(val, 0);
 			json_decref(val);
-			req = malloc(128 + 2*80 + strlen(work->txs) + strlen(params));
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s\", %s], \"id\":1}\r\n",
-				data_str, work->txs, params);
+			r->tail = malloc(32 + strlen(params));
+			if (r->tail)
+				sprintf(r->tail, "\", %s], \"id\":1}\r\n", params);
 			free(params);
-		} else {
-			req = malloc(128 + 2*80 + strlen(work->txs));
-			sprintf(req,
-				"{\"method\": \"submitblock\", \"params\": [\"%s%s\"], \"id\":1}\r\n",
-				data_str, work->txs);
-		}
-		val = json_rpc_call(curl, rpc_url, rpc_userpass, req, NULL, 0);
-		free(req);
-		if (unlikely(!val)) {
-			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-			goto out;
+			if (unlikely(!r->tail))
+				return -1;
 		}
 
-		res = json_object_get(val, "result");
+		/* the transactions are sent straight from the shared blob */
+		r->iov[0].buf = s;
+		r->iov[0].len = strlen(s);
+		r->iov[1].buf = work->txs->hex;
+		r->iov[1].len = work->txs->len;
+		r->iov[2].buf = r->tail ? r->tail : "\"], \"id\":1}\r\n";
+		r->iov[2].len = strlen(r->iov[2].buf);
+		r->iovcnt = 3;
+		return 1;
+	}
+
+	/* build hex string */
+	if (opt_algo == ALGO_M7M) {
+		for (i = 0; i < 32; i++)
+			be32enc(work->data + i, work->data[i]);
+	} else {
+		for (i = 0; i < 32; i++)
+			le32enc(work->data + i, work->data[i]);
+	}
+	bin2hex(data_str, (unsigned char *)work->data, sizeof(work->data));
+
+	/* build JSON-RPC request */
+	sprintf(s,
+		"{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
+		data_str);
+	r->iov[0].buf = s;
+	r->iov[0].len = strlen(s);
+	r->iovcnt = 1;
+	return 1;
+}
+
+/* Record the server's verdict on the work submitted by r. */
+static void submit_upstream_end(struct workio_req *r, json_t *val, int thr_id)
+{
+	json_t *res, *reason;
+
+	res = json_object_get(val, "result");
+	if (r->work.txs) {
 		if (json_is_object(res)) {
 			char *res_str;
 			bool sumres = false;
@@ -740,46 +1698,15 @@ static bool submit_upstream_work(CURL *curl, struct work *work)
 				iter = json_object_iter_next(res, iter);
 			}
 			res_str = json_dumps(res, 0);
-			share_result(sumres, res_str);
+			share_result(sumres, res_str, thr_id);
 			free(res_str);
 		} else
-			share_result(json_is_null(res), json_string_value(res));
-
-		json_decref(val);
+			share_result(json_is_null(res), json_string_value(res), thr_id);
 	} else {
-		/* build hex string */
-		if (opt_algo == ALGO_M7M) {
-			for (i = 0; i < 32; i++)
-				be32enc(work->data + i, work->data[i]);
-		} else {
-			for (i = 0; i < 32; i++)
-				le32enc(work->data + i, work->data[i]);
-		}
-		bin2hex(data_str, (unsigned char *)work->data, sizeof(work->data));
-
-		/* build JSON-RPC request */
-		sprintf(s,
-			"{\"method\": \"getwork\", \"params\": [ \"%s\" ], \"id\":1}\r\n",
-			data_str);
-
-		/* issue JSON-RPC request */
-		val = json_rpc_call(curl, rpc_url, rpc_userpass, s, NULL, 0);
-		if (unlikely(!val)) {
-			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
-			goto out;
-		}
-
-		res = json_object_get(val, "result");
 		reason = json_object_get(val, "reject-reason");
-		share_result(json_is_true(res), reason ? json_string_value(reason) : NULL);
-
-		json_decref(val);
+		share_result(json_is_true(res), reason ? json_string_value(reason) : NULL,
+		             thr_id);
 	}
-
-	rc = true;
-
-out:
-	return rc;
 }
 
 static const char *getwork_req =
@@ -794,56 +1721,57 @@ static const char *gbt_lp_req =
 	"{\"method\": \"getblocktemplate\", \"params\": [{\"capabilities\": "
 	GBT_CAPABILITIES ", \"longpollid\": \"%s\"}], \"id\":0}\r\n";
 
-static bool get_upstream_work(CURL *curl, struct work *work)
+/*
+ * Decode the answer to a work request sent by r into r->work.
+ * Returns 1 on success, 0 on failure and -1 if the request must be
+ * sent again, using the protocol that is now current.
+ */
+static int get_upstream_end(struct workio_req *r, json_t *val, int err)
 {
-	json_t *val;
-	int err;
-	bool rc;
-	struct timeval tv_start, tv_end, diff;
-
-start:
-	gettimeofday(&tv_start, NULL);
-	val = json_rpc_call(curl, rpc_url, rpc_userpass,
-			    have_gbt ? gbt_req : getwork_req,
-			    &err, have_gbt ? JSON_RPC_QUIET_404 : 0);
-	gettimeofday(&tv_end, NULL);
+	int rc;
 
 	if (have_stratum) {
 		if (val)
 			json_decref(val);
-		return true;
+		return 1;
 	}
 
 	if (!have_gbt && !allow_getwork) {
 		applog(LOG_ERR, "No usable protocol");
 		if (val)
 			json_decref(val);
-		return false;
+		return 0;
 	}
 
-	if (have_gbt && allow_getwork && !val && err == CURLE_OK) {
-		applog(LOG_INFO, "getblocktemplate failed, falling back to getwork");
-		have_gbt = false;
-		goto start;
+	if (r->gbt && allow_getwork && !val && err == CURLE_OK) {
+		if (have_gbt) {
+			applog(LOG_INFO, "getblocktemplate failed, falling back to getwork");
+			have_gbt = false;
+		}
+		return -1;
 	}
 
 	if (!val)
-		return false;
+		return 0;
+
+	/* another request may have switched protocols in the meantime */
+	if (r->gbt != have_gbt) {
+		json_decref(val);
+		return -1;
+	}
 
 	if (have_gbt) {
-		rc = gbt_work_decode(json_object_get(val, "result"), work);
+		rc = gbt_work_decode(json_object_get(val, "result"), &r->work);
 		if (!have_gbt) {
 			json_decref(val);
-			goto start;
+			return -1;
 		}
 	} else
-		rc = work_decode(json_object_get(val, "result"), work);
+		rc = work_decode(json_object_get(val, "result"), &r->work);
 
-	if (opt_debug && rc) {
-		timeval_subtract(&diff, &tv_end, &tv_start);
+	if (opt_debug && rc)
 		applog(LOG_DEBUG, "DEBUG: got new work in %d ms",
-		       diff.tv_sec * 1000 + diff.tv_usec / 1000);
-	}
+		       (int) ((mono_ns() - r->start) / 1000000));
 
 	json_decref(val);
 
@@ -856,10 +1784,18 @@ static void workio_cmd_free(struct workio_cmd *wc)
 		return;
 
 	switch (wc->cmd) {
+	case WC_QUIT:
+		return;
 	case WC_SUBMIT_WORK:
 		work_free(wc->u.work);
 		free(wc->u.work);
 		break;
+	case WC_SUBMIT_SHARE:
+		/* the command is part of the share, hand both back */
+		job_put(wc->u.share->job);
+		wc->u.share->job = NULL;
+		__atomic_store_n(&wc->u.share->busy, 0, __ATOMIC_RELEASE);
+		return;
 	default: /* do nothing */
 		break;
 	}
@@ -868,102 +1804,477 @@ static void workio_cmd_free(struct workio_cmd *wc)
 	free(wc);
 }
 
-static bool workio_get_work(struct workio_cmd *wc, CURL *curl)
+/*
+ * Work fetched ahead of time by the workio thread, so that miners do
+ * not have to wait for a round trip when their work expires.  Queued
+ * work is dropped when it gets older than the scan time, when longpoll
+ * brings new work, and when a newer block shows up.
+ */
+#define PREFETCH_MAX	8
+
+static struct work prefetch_work[PREFETCH_MAX];
+static uint64_t prefetch_time[PREFETCH_MAX];
+static int prefetch_count;
+static unsigned long prefetch_gen;
+static pthread_mutex_t prefetch_lock;
+
+/* Drop the n oldest prefetched work units; prefetch_lock must be held. */
+static void prefetch_drop(int n)
 {
-	struct work *ret_work;
-	int failures = 0;
+	int i;
 
-	ret_work = calloc(1, sizeof(*ret_work));
-	if (!ret_work)
-		return false;
+	for (i = 0; i < n; i++)
+		work_free(&prefetch_work[i]);
+	memmove(prefetch_work, prefetch_work + n,
+	        (prefetch_count - n) * sizeof(*prefetch_work));
+	memmove(prefetch_time, prefetch_time + n,
+	        (prefetch_count - n) * sizeof(*prefetch_time));
+	prefetch_count -= n;
+}
 
-	/* obtain new work from bitcoin via JSON-RPC */
-	while (!get_upstream_work(curl, ret_work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "json_rpc_call failed, terminating workio thread");
-			free(ret_work);
-			return false;
-		}
+/* Drop everything queued if work is on a newer block than the queue. */
+static void prefetch_newblock(const struct work *work)
+{
+	pthread_mutex_lock(&prefetch_lock);
+	if (prefetch_count &&
+	    memcmp(work->data + 1, prefetch_work[0].data + 1, 32)) {
+		prefetch_drop(prefetch_count);
+		prefetch_gen++;
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
 
-		/* pause, then restart work-request loop */
-		applog(LOG_ERR, "json_rpc_call failed, retry after %d seconds",
-			opt_fail_pause);
-		sleep(opt_fail_pause);
+static void prefetch_flush(void)
+{
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_drop(prefetch_count);
+	prefetch_gen++;
+	pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * Take the oldest prefetched work that is still fresh, if any, along
+ * with the time it was fetched.
+ */
+static bool prefetch_take(struct work *work, uint64_t *fetched)
+{
+	uint64_t scantime = (have_longpoll ? LP_SCANTIME : opt_scantime)
+	                    * NSEC_PER_SEC;
+	uint64_t now = mono_ns();
+	bool rc = false;
+	int n;
+
+	pthread_mutex_lock(&prefetch_lock);
+	for (n = 0; n < prefetch_count && now - prefetch_time[n] >= scantime; n++);
+	prefetch_drop(n);
+	if (prefetch_count) {
+		work_free(work);
+		memcpy(work, &prefetch_work[0], sizeof(*work));
+		memset(&prefetch_work[0], 0, sizeof(*work));
+		*fetched = prefetch_time[0];
+		prefetch_drop(1);
+		rc = true;
 	}
+	pthread_mutex_unlock(&prefetch_lock);
+	return rc;
+}
 
-	/* send work to requesting thread */
-	if (!tq_push(wc->thr->q, ret_work))
-		free(ret_work);
+/* Queue the work prefetched by r, unless it was flushed in the meantime. */
+static void prefetch_store(struct workio_req *r)
+{
+	prefetch_newblock(&r->work);
+	pthread_mutex_lock(&prefetch_lock);
+	if (r->gen == prefetch_gen && prefetch_count < opt_prefetch) {
+		memcpy(&prefetch_work[prefetch_count], &r->work, sizeof(r->work));
+		memset(&r->work, 0, sizeof(r->work));
+		prefetch_time[prefetch_count++] = mono_ns();
+	}
+	pthread_mutex_unlock(&prefetch_lock);
+}
 
-	return true;
+/* Ask the workio thread to top up the prefetch queue. */
+static void prefetch_request(struct thr_info *thr)
+{
+	struct workio_cmd *wc;
+
+	if (!opt_prefetch || have_stratum)
+		return;
+	wc = calloc(1, sizeof(*wc));
+	if (!wc)
+		return;
+	wc->cmd = WC_PREFETCH;
+	wc->thr = thr;
+	if (!tq_push(thr_info[work_thr_id].q, wc))
+		workio_cmd_free(wc);
 }
 
-static bool workio_submit_work(struct workio_cmd *wc, CURL *curl)
+/* Rebuild the work a share was found on; strings stay with the job. */
+static void share_work(const struct share *share, struct work *work)
 {
-	int failures = 0;
+	memcpy(work, &share->job->work, sizeof(*work));
+	memcpy(work->data, share->data, sizeof(work->data));
+	work->xnonce2_len = share->xnonce2_len;
+	work->xnonce2 = (unsigned char *)share->xnonce2;
+}
 
-	/* submit solution to bitcoin via JSON-RPC */
-	while (!submit_upstream_work(curl, wc->u.work)) {
-		if (unlikely((opt_retries >= 0) && (++failures > opt_retries))) {
-			applog(LOG_ERR, "...terminating workio thread");
-			return false;
-		}
+static int workio_prio(const struct workio_cmd *wc)
+{
+	switch (wc->cmd) {
+	case WC_SUBMIT_WORK:
+		return wc->u.work->txs ? WP_BLOCK : WP_SHARE;
+	case WC_SUBMIT_SHARE:
+		return wc->u.share->job->work.txs ? WP_BLOCK : WP_SHARE;
+	case WC_GET_WORK:
+		return WP_FETCH;
+	default:
+		return WP_PREFETCH;
+	}
+}
+
+/* Whether r may take a handle, given what is already in flight. */
+static bool workio_may_start(const struct workio_req *r, int n_active,
+                             int n_shares)
+{
+	if (n_active == WORKIO_HANDLES)
+		return false;
+	if (r->prio == WP_BLOCK)
+		return true;
+	if (n_active >= WORKIO_HANDLES - 1)
+		return false;
+	return r->prio != WP_SHARE || n_shares < WORKIO_HANDLES - 2;
+}
+
+/* Insert r after the requests of the same or a higher priority. */
+static void workio_req_queue(struct workio_req **list, struct workio_req *r)
+{
+	while (*list && (*list)->prio <= r->prio)
+		list = &(*list)->next;
+	r->next = *list;
+	*list = r;
+}
+
+static void workio_req_free(struct workio_req *r)
+{
+	/* submissions only borrow the strings of their work */
+	if (r->wc->cmd == WC_GET_WORK || r->wc->cmd == WC_PREFETCH)
+		work_free(&r->work);
+	free(r->tail);
+	workio_cmd_free(r->wc);
+	free(r);
+}
+
+/*
+ * Prepare r and start its request on curl.
+ * Returns 1 if it was sent, 0 if it is done already and -1 on failure.
+ */
+static int workio_req_start(struct workio_req *r, CURL *curl)
+{
+	struct workio_cmd *wc = r->wc;
+	const char *req;
+	int rc, flags = 0;
+
+	switch (wc->cmd) {
+	case WC_PREFETCH:
+		pthread_mutex_lock(&prefetch_lock);
+		rc = prefetch_count < opt_prefetch;
+		r->gen = prefetch_gen;
+		pthread_mutex_unlock(&prefetch_lock);
+		if (!rc || have_stratum)
+			return 0;
+		/* fall through */
+	case WC_GET_WORK:
+		work_free(&r->work);
+		memset(&r->work, 0, sizeof(r->work));
+		r->gbt = have_gbt;
+		req = r->gbt ? gbt_req : getwork_req;
+		r->iov[0].buf = req;
+		r->iov[0].len = strlen(req);
+		r->iovcnt = 1;
+		if (r->gbt)
+			flags = JSON_RPC_QUIET_404;
+		break;
+	case WC_SUBMIT_WORK:
+	case WC_SUBMIT_SHARE:
+		/* submit_upstream_begin() encodes the header in place */
+		if (wc->cmd == WC_SUBMIT_SHARE)
+			share_work(wc->u.share, &r->work);
+		else
+			memcpy(&r->work, wc->u.work, sizeof(r->work));
+		rc = submit_upstream_begin(r, wc->thr->id);
+		if (rc <= 0)
+			return rc;
+		break;
+	default:		/* should never happen */
+		return -1;
+	}
+
+	r->start = mono_ns();
+	r->rpc = json_rpc_begin(curl, rpc_url, rpc_userpass, r->iov, r->iovcnt,
+	                        flags);
+	return r->rpc ? 1 : -1;
+}
 
-		/* pause, then restart work-request loop */
-		applog(LOG_ERR, "...retry after %d seconds",
-			opt_fail_pause);
-		sleep(opt_fail_pause);
+/*
+ * Handle the answer to the request of r.
+ * Returns 1 if r is done, 0 on failure and -1 if it must be sent again.
+ */
+static int workio_req_finish(struct workio_req *r, json_t *val, int err)
+{
+	struct workio_cmd *wc = r->wc;
+	struct work *work;
+	int rc;
+
+	switch (wc->cmd) {
+	case WC_GET_WORK:
+		rc = get_upstream_end(r, val, err);
+		if (rc <= 0)
+			return rc;
+		work = malloc(sizeof(*work));
+		if (!work)
+			return 0;
+		memcpy(work, &r->work, sizeof(*work));
+		memset(&r->work, 0, sizeof(r->work));
+		if (!have_stratum)
+			prefetch_newblock(work);
+
+		/* send work to requesting thread */
+		if (!tq_push(wc->thr->q, work)) {
+			work_free(work);
+			free(work);
+		}
+		return 1;
+	case WC_PREFETCH:
+		/* on failure, leave the retrying to the miners' own requests */
+		rc = get_upstream_end(r, val, err);
+		if (!rc || have_stratum)
+			return 1;
+		if (rc > 0)
+			prefetch_store(r);
+		return -1;	/* top up until the queue is full */
+	default:
+		if (unlikely(!val)) {
+			applog(LOG_ERR, "submit_upstream_work json_rpc_call failed");
+			return 0;
+		}
+		submit_upstream_end(r, val, wc->thr->id);
+		json_decref(val);
+		return 1;
 	}
+}
 
+/* Schedule a failed request for a retry; returns false to give up. */
+static bool workio_req_failed(struct workio_req *r)
+{
+	const char *what = r->wc->cmd == WC_GET_WORK ? "json_rpc_call failed, " : "...";
+
+	if (r->wc->cmd == WC_PREFETCH)
+		return false;
+	if (unlikely((opt_retries >= 0) && (++r->failures > opt_retries))) {
+		applog(LOG_ERR, "%sterminating workio thread", what);
+		return false;
+	}
+	applog(LOG_ERR, "%sretry after %d seconds", what, opt_fail_pause);
+	r->not_before = mono_ns() + (uint64_t) opt_fail_pause * NSEC_PER_SEC;
 	return true;
 }
 
+/* Asks the workio thread to exit, behind the commands already queued. */
+static struct workio_cmd workio_quit = { WC_QUIT };
+
 static void *workio_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
-	CURL *curl;
-	bool ok = true;
-
-	curl = curl_easy_init();
-	if (unlikely(!curl)) {
+	struct workio_req *pending = NULL, *retry, *active[WORKIO_HANDLES] = { NULL };
+	struct workio_req *r, **rp;
+	CURL *curl[WORKIO_HANDLES] = { NULL };
+	CURLM *multi;
+	int i, rc, running, left, n_active = 0, n_shares = 0;
+	bool prefetching = false, ok = true;
+
+	multi = curl_multi_init();
+	for (i = 0; multi && i < WORKIO_HANDLES; i++) {
+		curl[i] = json_rpc_handle();
+		if (!curl[i])
+			break;
+	}
+	if (unlikely(i < WORKIO_HANDLES)) {
 		applog(LOG_ERR, "CURL initialization failed");
-		return NULL;
+		goto out;
 	}
 
 	while (ok) {
 		struct workio_cmd *wc;
+		struct timespec abstime;
+		struct timeval tv;
+		uint64_t now = mono_ns(), wait = 0;
+		bool finished = false;
+
+		/* when idle, sleep on the queue until the next retry is due */
+		if (!n_active && pending) {
+			wait = UINT64_MAX;
+			for (r = pending; r; r = r->next)
+				if (r->not_before <= now)
+					wait = 0;
+				else if (r->not_before - now < wait)
+					wait = r->not_before - now;
+		}
 
-		/* wait for workio_cmd sent to us, on our queue */
-		wc = tq_pop(mythr->q, NULL);
-		if (!wc) {
-			ok = false;
-			break;
+		/* take in the commands sent to us, on our queue */
+		for (;;) {
+			if (!n_active && !pending) {
+				wc = tq_pop(mythr->q, NULL);
+				if (!wc) {
+					ok = false;
+					break;
+				}
+			} else {
+				gettimeofday(&tv, NULL);
+				wait += tv.tv_usec * 1000ULL;
+				abstime.tv_sec = tv.tv_sec + wait / NSEC_PER_SEC;
+				abstime.tv_nsec = wait % NSEC_PER_SEC;
+				wc = tq_pop(mythr->q, &abstime);
+				if (!wc)
+					break;
+			}
+			wait = 0;
+			if (wc->cmd == WC_QUIT) {
+				ok = false;
+				break;
+			}
+			if (wc->cmd == WC_PREFETCH && prefetching) {
+				workio_cmd_free(wc);
+				continue;
+			}
+			r = calloc(1, sizeof(*r));
+			if (unlikely(!r)) {
+				workio_cmd_free(wc);
+				ok = false;
+				break;
+			}
+			r->wc = wc;
+			r->prio = workio_prio(wc);
+			if (wc->cmd == WC_PREFETCH)
+				prefetching = true;
+			workio_req_queue(&pending, r);
 		}
 
-		/* process workio_cmd */
-		switch (wc->cmd) {
-		case WC_GET_WORK:
-			ok = workio_get_work(wc, curl);
-			break;
-		case WC_SUBMIT_WORK:
-			ok = workio_submit_work(wc, curl);
-			break;
+		/* start what is due, by priority, while handles are free */
+		now = mono_ns();
+		retry = NULL;
+		for (rp = &pending; ok && (r = *rp); ) {
+			if (r->not_before > now ||
+			    !workio_may_start(r, n_active, n_shares)) {
+				rp = &r->next;
+				continue;
+			}
+			*rp = r->next;
+			for (i = 0; active[i]; i++);
+			rc = workio_req_start(r, curl[i]);
+			if (rc > 0) {
+				curl_multi_add_handle(multi, curl[i]);
+				active[i] = r;
+				n_active++;
+				n_shares += r->prio == WP_SHARE;
+				continue;
+			}
+			if (rc < 0 && workio_req_failed(r)) {
+				r->next = retry;
+				retry = r;
+				continue;
+			}
+			if (rc < 0 && r->wc->cmd != WC_PREFETCH)
+				ok = false;
+			if (r->wc->cmd == WC_PREFETCH)
+				prefetching = false;
+			workio_req_free(r);
+		}
+		while ((r = retry)) {
+			retry = r->next;
+			workio_req_queue(&pending, r);
+		}
+		if (!ok || !n_active)
+			continue;
 
-		default:		/* should never happen */
-			ok = false;
-			break;
+		/* move the transfers along and collect the finished ones */
+		curl_multi_perform(multi, &running);
+		for (;;) {
+			CURLMsg *msg = curl_multi_info_read(multi, &left);
+			CURLcode res;
+			json_t *val;
+			int err;
+
+			if (!msg)
+				break;
+			if (msg->msg != CURLMSG_DONE)
+				continue;
+			for (i = 0; curl[i] != msg->easy_handle; i++);
+			res = msg->data.result;
+			curl_multi_remove_handle(multi, curl[i]);
+			r = active[i];
+			active[i] = NULL;
+			n_active--;
+			n_shares -= r->prio == WP_SHARE;
+			finished = true;
+
+			val = json_rpc_end(r->rpc, res, &err);
+			r->rpc = NULL;
+			rc = workio_req_finish(r, val, err);
+			if (rc < 0 || (!rc && workio_req_failed(r))) {
+				if (rc < 0)
+					r->not_before = 0;
+				workio_req_queue(&pending, r);
+				continue;
+			}
+			if (!rc && r->wc->cmd != WC_PREFETCH)
+				ok = false;
+			if (r->wc->cmd == WC_PREFETCH)
+				prefetching = false;
+			workio_req_free(r);
 		}
+		if (finished || !n_active)
+			continue;
 
-		workio_cmd_free(wc);
+		/* wait for some network activity, but not for too long */
+#if LIBCURL_VERSION_NUM >= 0x071c00
+		curl_multi_wait(multi, NULL, 0, WORKIO_POLL_MS, NULL);
+#else
+		{
+			fd_set rfds, wfds, efds;
+			int maxfd = -1;
+
+			FD_ZERO(&rfds);
+			FD_ZERO(&wfds);
+			FD_ZERO(&efds);
+			curl_multi_fdset(multi, &rfds, &wfds, &efds, &maxfd);
+			tv.tv_sec = 0;
+			tv.tv_usec = WORKIO_POLL_MS * 1000;
+			if (maxfd >= 0)
+				select(maxfd + 1, &rfds, &wfds, &efds, &tv);
+			else
+				usleep(WORKIO_POLL_MS * 1000);
+		}
+#endif
 	}
 
+out:
 	tq_freeze(mythr->q);
-	curl_easy_cleanup(curl);
+	for (i = 0; i < WORKIO_HANDLES; i++) {
+		if (active[i])
+			curl_multi_remove_handle(multi, curl[i]);
+	}
+	if (multi)
+		curl_multi_cleanup(multi);
+	for (i = 0; i < WORKIO_HANDLES; i++) {
+		if (curl[i])
+			curl_easy_cleanup(curl[i]);
+	}
 
 	return NULL;
 }
 
-static bool get_work(struct thr_info *thr, struct work *work)
+/* Get fresh work, and the time it was fetched, for thread thr. */
+static bool get_work(struct thr_info *thr, struct work *work,
+                     uint64_t *fetched)
 {
 	struct workio_cmd *wc;
 	struct work *work_heap;
@@ -975,6 +2286,12 @@ static bool get_work(struct thr_info *thr, struct work *work)
 		work->data[20] = 0x80000000;
 		work->data[31] = 0x00000280;
 		memset(work->target, 0x00, sizeof(work->target));
+		*fetched = mono_ns();
+		return true;
+	}
+
+	if (prefetch_take(work, fetched)) {
+		prefetch_request(thr);
 		return true;
 	}
 
@@ -998,17 +2315,45 @@ static bool get_work(struct thr_info *thr, struct work *work)
 		return false;
 
 	/* copy returned work into storage provided by caller */
+	work_free(work);
 	memcpy(work, work_heap, sizeof(*work));
 	free(work_heap);
+	*fetched = mono_ns();
 
+	prefetch_request(thr);
 	return true;
 }
 
-static bool submit_work(struct thr_info *thr, const struct work *work_in)
+static bool submit_work(struct thr_info *thr, const struct work *work_in,
+			struct job *job)
 {
 	struct workio_cmd *wc;
-	
-	/* fill out work request message */
+	struct share *share = &shares[thr->id * SHARE_SLOTS];
+	int i;
+
+	for (i = 0; i < SHARE_SLOTS; i++)
+		if (!__atomic_load_n(&share[i].busy, __ATOMIC_ACQUIRE))
+			break;
+	if (i < SHARE_SLOTS && work_in->xnonce2_len <= SHARE_XNONCE2_MAX) {
+		share += i;
+		share->busy = 1;
+		__atomic_add_fetch(&job->refcnt, 1, __ATOMIC_RELAXED);
+		share->job = job;
+		memcpy(share->data, work_in->data, sizeof(share->data));
+		share->xnonce2_len = work_in->xnonce2_len;
+		if (work_in->xnonce2_len)
+			memcpy(share->xnonce2, work_in->xnonce2, work_in->xnonce2_len);
+		share->wc.cmd = WC_SUBMIT_SHARE;
+		share->wc.thr = thr;
+		share->wc.u.share = share;
+		if (!tq_push(thr_info[work_thr_id].q, &share->wc)) {
+			workio_cmd_free(&share->wc);
+			return false;
+		}
+		return true;
+	}
+
+	/* all slots are waiting for the server: fall back to a copy */
 	wc = calloc(1, sizeof(*wc));
 	if (!wc)
 		return false;
@@ -1087,14 +2432,472 @@ static void stratum_gen_work(struct stratum_ctx *sctx, struct work *work)
 		diff_to_target(work->target, sctx->job.diff);
 }
 
+/* Copy the coinbase past the cached midstate, with the given extranonce2. */
+static void job_coinbase_tail(const struct job *job, unsigned char *tail,
+	uint64_t xnonce2)
+{
+	unsigned char *p = tail + job->xnonce2_offset - job->coinbase_prefix;
+	int i;
+
+	memcpy(tail, job->coinbase + job->coinbase_prefix,
+	       job->coinbase_size - job->coinbase_prefix);
+	for (i = 0; i < job->work.xnonce2_len; i++) {
+		p[i] = xnonce2 & 0xff;
+		xnonce2 = i < 7 ? xnonce2 >> 8 : 0;
+	}
+}
+
+/*
+ * Compute the merkle roots, as they go into work->data, for up to
+ * PREP_BATCH coinbase tails stored back to back.
+ */
+static void job_merkle_roots(const struct job *job, const unsigned char *tails,
+	int n, uint32_t (*roots)[8])
+{
+	unsigned char hash[PREP_BATCH][32];
+	unsigned char buf[PREP_BATCH][64];
+	uint32_t init[8];
+	int i, k;
+
+	sha256d_resume_multi(hash[0], job->coinbase_midstate, tails,
+	                     job->coinbase_size - job->coinbase_prefix,
+	                     job->coinbase_size, n);
+	sha256_init(init);
+	for (i = 0; i < job->merkle_count; i++) {
+		for (k = 0; k < n; k++) {
+			memcpy(buf[k], hash[k], 32);
+			memcpy(buf[k] + 32, job->merkle[i], 32);
+		}
+		sha256d_resume_multi(hash[0], init, buf[0], 64, 64, n);
+	}
+	for (k = 0; k < n; k++) {
+		if (opt_algo == ALGO_M7M) {
+			memcpy(roots[k], hash[k], 32);
+			continue;
+		}
+		for (i = 0; i < 8; i++)
+			roots[k][i] = be32dec((uint32_t *)hash[k] + i);
+	}
+}
+
+/*
+ * Build a header with our own extranonce2 from a stratum job snapshot.
+ * Each thread uses the extranonce2 values congruent to its id modulo
+ * the number of threads, so that no two threads ever share a header.
+ * Only the coinbase tail is kept in *tail; the rest is in the midstate.
+ */
+static bool stratum_thread_work(const struct job *job, struct work *work,
+	int thr_id, uint64_t seq, unsigned char **tail, size_t *size)
+{
+	size_t tail_size = job->coinbase_size - job->coinbase_prefix;
+
+	if (!job->coinbase_size)
+		return false;
+	if (*size < tail_size) {
+		free(*tail);
+		*tail = malloc(tail_size);
+		*size = *tail ? tail_size : 0;
+		if (!*tail)
+			return false;
+	}
+	job_coinbase_tail(job, *tail, seq * opt_n_threads + thr_id);
+	work->xnonce2 = *tail + job->xnonce2_offset - job->coinbase_prefix;
+	job_merkle_roots(job, *tail, 1, (uint32_t (*)[8])(work->data + 9));
+
+	if (opt_debug) {
+		char *xnonce2str = abin2hex(work->xnonce2, work->xnonce2_len);
+		applog(LOG_DEBUG, "DEBUG: thread %d: job_id='%s' extranonce2=%s",
+		       thr_id, work->job_id, xnonce2str);
+		free(xnonce2str);
+	}
+	return true;
+}
+
+/* Take the next prepared header for the given job, if there is one. */
+static bool prep_pop(int thr_id, const struct job *job, struct work *work,
+	unsigned char *xnonce2)
+{
+	struct prep_ring *ring = &prep_rings[thr_id];
+	struct prep_header h;
+	unsigned long head, tail;
+	bool found = false;
+
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	while (!found && head != tail) {
+		h = ring->slot[head % PREP_DEPTH];
+		/* if the producer dropped it meanwhile, the copy is void */
+		if (!__atomic_compare_exchange_n(&ring->head, &head, head + 1, false,
+		                                 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+		found = h.epoch == job->epoch;
+		head++;
+	}
+	if (!found)
+		return false;
+	if (tail - head < PREP_DEPTH / 2 + 1)
+		prep_wake();
+
+	memcpy(work->data + 9, h.merkle_root, 32);
+	memcpy(xnonce2, h.xnonce2, work->xnonce2_len);
+	work->xnonce2 = xnonce2;
+	return true;
+}
+
+/*
+ * Wait for the producer to put something in the empty ring of thread
+ * thr_id, or for the job to change.  The producer is woken only once.
+ */
+static void prep_wait(int thr_id, const struct job *job)
+{
+	struct prep_ring *ring = &prep_rings[thr_id];
+	struct timespec abstime;
+	struct timeval tv;
+
+	prep_wake();
+	pthread_mutex_lock(&ring->lock);
+	__atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) ==
+	       __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) &&
+	       !work_restart[thr_id].restart &&
+	       __atomic_load_n(&g_job_epoch, __ATOMIC_ACQUIRE) == job->epoch) {
+		gettimeofday(&tv, NULL);
+		tv.tv_usec += PREP_WAIT_MS * 1000;
+		abstime.tv_sec = tv.tv_sec + tv.tv_usec / 1000000;
+		abstime.tv_nsec = tv.tv_usec % 1000000 * 1000;
+		pthread_cond_timedwait(&ring->cond, &ring->lock, &abstime);
+	}
+	__atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ring->lock);
+}
+
+struct prep_request {
+	struct prep_ring *ring;
+	unsigned long tail;
+};
+
+/* Hash a batch of coinbase tails at once and publish the headers. */
+static void prep_fill(const struct job *job, struct prep_request *req, int n,
+	const unsigned char *tails)
+{
+	uint32_t roots[PREP_BATCH][8];
+	size_t tail_size = job->coinbase_size - job->coinbase_prefix;
+	size_t off = job->xnonce2_offset - job->coinbase_prefix;
+	int k;
+
+	job_merkle_roots(job, tails, n, roots);
+	for (k = 0; k < n; k++) {
+		struct prep_header *h = &req[k].ring->slot[req[k].tail % PREP_DEPTH];
+
+		h->epoch = job->epoch;
+		memcpy(h->merkle_root, roots[k], 32);
+		memcpy(h->xnonce2, tails + k * tail_size + off, job->work.xnonce2_len);
+		__atomic_store_n(&req[k].ring->tail, req[k].tail + 1, __ATOMIC_SEQ_CST);
+		/* pairs with the check of tail in prep_wait() */
+		if (__atomic_load_n(&req[k].ring->waiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&req[k].ring->lock);
+			pthread_cond_signal(&req[k].ring->cond);
+			pthread_mutex_unlock(&req[k].ring->lock);
+		}
+	}
+}
+
+static void *prep_thread(void *userdata)
+{
+	struct job *job = NULL;
+	struct prep_request req[PREP_BATCH];
+	unsigned char *tails = NULL;
+	size_t tails_size = 0, tail_size;
+	char job_id[128] = "";
+	uint64_t *seq;
+	unsigned long *tail;
+	int i, n, depth;
+
+	seq = calloc(opt_n_threads, sizeof(*seq));
+	tail = calloc(opt_n_threads, sizeof(*tail));
+	if (!seq || !tail) {
+		applog(LOG_ERR, "header preparation disabled: out of memory");
+		return NULL;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&prep_lock);
+		while (!prep_wanted)
+			pthread_cond_wait(&prep_cond, &prep_lock);
+		prep_wanted = false;
+		pthread_mutex_unlock(&prep_lock);
+
+		if (!job || __atomic_load_n(&g_job_epoch, __ATOMIC_ACQUIRE) != job->epoch) {
+			job_put(job);
+			job = job_get();
+			if (!job)
+				continue;
+			/* extranonce2 keeps counting as long as the job is the same */
+			if (job->work.job_id &&
+			    strncmp(job_id, job->work.job_id, sizeof(job_id) - 1)) {
+				snprintf(job_id, sizeof(job_id), "%s", job->work.job_id);
+				memset(seq, 0, opt_n_threads * sizeof(*seq));
+			}
+		}
+		if (!job->coinbase_size || job->work.xnonce2_len > PREP_XNONCE2_MAX)
+			continue;
+		tail_size = job->coinbase_size - job->coinbase_prefix;
+		if (tails_size < PREP_BATCH * tail_size) {
+			free(tails);
+			tails = malloc(PREP_BATCH * tail_size);
+			tails_size = tails ? PREP_BATCH * tail_size : 0;
+			if (!tails)
+				continue;
+		}
+
+		/* drop the headers of older jobs */
+		for (i = 0; i < opt_n_threads; i++) {
+			struct prep_ring *ring = &prep_rings[i];
+			unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+			tail[i] = ring->tail;
+			while (head != tail[i] &&
+			       ring->slot[head % PREP_DEPTH].epoch != job->epoch)
+				__atomic_compare_exchange_n(&ring->head, &head, head + 1,
+				                            false, __ATOMIC_ACQ_REL,
+				                            __ATOMIC_ACQUIRE);
+		}
+
+		/* fill the rings level by level, so that each miner gets
+		 * its next header before any ring gets a deeper one */
+		n = 0;
+		for (depth = 1; depth <= PREP_DEPTH; depth++) {
+			for (i = 0; i < opt_n_threads; i++) {
+				struct prep_ring *ring = &prep_rings[i];
+
+				if (tail[i] - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)
+				    >= depth)
+					continue;
+				req[n].ring = ring;
+				req[n].tail = tail[i]++;
+				job_coinbase_tail(job, tails + n * tail_size,
+				                  seq[i]++ * opt_n_threads + i);
+				if (++n == PREP_BATCH) {
+					prep_fill(job, req, n, tails);
+					n = 0;
+				}
+			}
+		}
+		if (n)
+			prep_fill(job, req, n, tails);
+	}
+
+	return NULL;
+}
+
+static int topo_cmp(const void *a, const void *b)
+{
+	const struct cpu_topo *x = a, *y = b;
+
+	switch (opt_placement) {
+	case PLACE_SPREAD:
+		if (x->smt != y->smt)
+			return x->smt - y->smt;
+		if (x->rank != y->rank)
+			return x->rank - y->rank;
+		if (x->llc != y->llc)
+			return x->llc - y->llc;
+		break;
+	case PLACE_CORES:
+		if (x->smt != y->smt)
+			return x->smt - y->smt;
+		if (x->llc != y->llc)
+			return x->llc - y->llc;
+		break;
+	default:
+		if (x->llc != y->llc)
+			return x->llc - y->llc;
+		if (x->core != y->core)
+			return x->core - y->core;
+		break;
+	}
+	return x->cpu - y->cpu;
+}
+
+/*
+ * Choose the CPU each miner thread is bound to.  Without topology
+ * information, fall back to thread i on the i-th allowed CPU, modulo
+ * their count.
+ */
+static void plan_placement(void)
+{
+	struct cpu_topo *topo = NULL;
+	int *cpus;
+	int n, m, i, j, cores = 0, llcs = 0, nodes = 0;
+	bool known;
+
+	for (i = 0; i < opt_n_threads; i++)
+		thr_cpu[i] = -1;
+
+	n = read_topology(&topo);
+	known = n > 0;
+	if (!known) {
+		free(topo);
+		n = num_processors;
+		topo = calloc(n, sizeof(*topo));
+		cpus = calloc(n, sizeof(*cpus));
+		if (!topo || !cpus) {
+			free(topo);
+			free(cpus);
+			return;
+		}
+		/* num_processors only counts the CPUs in our affinity mask */
+		m = cpus_allowed_list(cpus, n);
+		if (m > 0)
+			n = m;
+		for (i = 0; i < n; i++) {
+			topo[i].cpu = topo[i].core = m > 0 ? cpus[i] : i;
+			topo[i].node = -1;
+		}
+		free(cpus);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (topo[i].smt == 0)
+			cores++;
+		for (j = 0; j < i && topo[j].llc != topo[i].llc; j++);
+		if (j == i)
+			llcs++;
+		for (j = 0; j < i && topo[j].node != topo[i].node; j++);
+		if (j == i && topo[i].node >= 0)
+			nodes++;
+	}
+	if (known)
+		applog(LOG_INFO, "%d CPUs in %d cores, %d LLC domains, %d NUMA nodes",
+		       n, cores, llcs, nodes);
+
+	/* binding only makes sense if every CPU gets the same load */
+	if (opt_placement == PLACE_NONE || n < 2 ||
+	    (opt_n_threads > n && opt_n_threads % n))
+		goto out;
+
+	qsort(topo, n, sizeof(*topo), topo_cmp);
+	for (i = 0; i < opt_n_threads; i++) {
+		struct cpu_topo *t = &topo[i % n];
+
+		thr_cpu[i] = t->cpu;
+		if (opt_quiet)
+			continue;
+		if (known)
+			applog(LOG_INFO, "Binding thread %d to cpu %d "
+			       "(core %d, LLC %d, node %d)",
+			       i, t->cpu, t->core, t->llc, t->node);
+		else
+			applog(LOG_INFO, "Binding thread %d to cpu %d", i, t->cpu);
+	}
+out:
+	free(topo);
+}
+
+#define QUOTA_CHECK_INTERVAL	30
+
+/* Wait until the CPU quota leaves room for this thread again. */
+static void park_thread(int thr_id)
+{
+	pthread_mutex_lock(&park_lock);
+	while (thr_id >= active_threads)
+		pthread_cond_wait(&park_cond, &park_lock);
+	pthread_mutex_unlock(&park_lock);
+}
+
+/* Follow changes of the CPU quota, unless the user chose a thread count. */
+static void update_active_threads(void)
+{
+	static uint64_t next_check;
+	uint64_t now = mono_ns();
+	int i, n;
+
+	if (!auto_threads || now < next_check)
+		return;
+	next_check = now + QUOTA_CHECK_INTERVAL * NSEC_PER_SEC;
+
+	n = cpu_quota();
+	if (!n || n > opt_n_threads)
+		n = opt_n_threads;
+	if (n == active_threads)
+		return;
+	applog(LOG_INFO, "CPU quota changed, using %d of %d miner threads",
+	       n, opt_n_threads);
+	pthread_mutex_lock(&park_lock);
+	__atomic_store_n(&active_threads, n, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&park_cond);
+	pthread_mutex_unlock(&park_lock);
+	for (i = n; i < opt_n_threads; i++)
+		work_restart[i].restart = 1;
+}
+
+/*
+ * Scans are sized from an average of each thread's hashrate so that
+ * they end close to the work's deadline, and are split in slices short
+ * enough to notice a new job quickly.
+ */
+#define SCAN_CHUNK_NS		(4 * NSEC_PER_SEC)
+#define RATE_TAU_NS		(5 * NSEC_PER_SEC)
+
+/* Number of nonces that take about ns at rate hashes per second. */
+static int64_t scan_nonces(double rate, uint64_t ns)
+{
+	double n = rate * 1e-9 * ns;
+
+	if (n > 0x10000000)
+		n = 0x10000000;
+	return ((int64_t)n + NONCE_ALIGN) / NONCE_ALIGN * NONCE_ALIGN;
+}
+
+/* Nonces to scan before any hashrate is known; short on any CPU. */
+static int64_t scan_probe(void)
+{
+	int64_t n;
+
+	switch (opt_algo) {
+	case ALGO_SCRYPT:
+		n = opt_scrypt_n < 16 ? 0x3fff : 0x3ffff / opt_scrypt_n;
+		break;
+	case ALGO_SHA256D:
+		n = 0x1ffff;
+		break;
+	default:
+		n = 0;
+		break;
+	}
+	/* like scan_nonces(), never empty and whole kernel batches */
+	return (n + NONCE_ALIGN) / NONCE_ALIGN * NONCE_ALIGN;
+}
+
+/* Fold a measurement into an exponentially weighted moving average. */
+static double rate_update(double rate, uint64_t hashes, uint64_t ns)
+{
+	double sample;
+
+	if (!ns)
+		return rate;
+	sample = 1e9 * hashes / ns;
+	if (!rate)
+		return sample;
+	return rate + (sample - rate) * ns / (ns + RATE_TAU_NS);
+}
+
 static void *miner_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
 	int thr_id = mythr->id;
 	struct work work = {{0}};
-	uint32_t max_nonce;
-	uint32_t end_nonce = 0xffffffffU / opt_n_threads * (thr_id + 1) - 0x20;
+	struct job *job = NULL;
+	bool exhausted = false;
+	unsigned char *coinbase = NULL;
+	size_t coinbase_size = 0;
+	char xnonce2_job[128] = "";
+	uint64_t xnonce2_seq = 0;
+	unsigned char xnonce2[PREP_XNONCE2_MAX];
 	unsigned char *scratchbuf = NULL;
+	double rate = 0.;	/* moving average of our hashrate */
+	uint64_t slice_ns = opt_switch_latency * 1000000ULL;
+	bool switched = false;
 	char s[16];
 	int i;
 
@@ -1106,14 +2909,12 @@ static void *miner_thread(void *userdata)
 		drop_policy();
 	}
 
-	/* Cpu affinity only makes sense if the number of threads is a multiple
-	 * of the number of CPUs */
-	if (num_processors > 1 && opt_n_threads % num_processors == 0) {
-		if (!opt_quiet)
-			applog(LOG_INFO, "Binding thread %d to cpu %d",
-			       thr_id, thr_id % num_processors);
-		affine_to_cpu(thr_id, thr_id % num_processors);
-	}
+	/* bind before allocating, so that our memory is on the local node */
+	if (thr_cpu[thr_id] >= 0)
+		affine_to_cpu(thr_id, thr_cpu[thr_id]);
+
+	/* do not allocate anything until the quota lets us run */
+	park_thread(thr_id);
 	
 	if (opt_algo == ALGO_SCRYPT) {
 		scratchbuf = scrypt_buffer_alloc(opt_scrypt_n);
@@ -1126,126 +2927,202 @@ static void *miner_thread(void *userdata)
 
 	while (1) {
 		unsigned long hashes_done;
-		struct timeval tv_start, tv_end, diff;
-		int64_t max64;
+		uint64_t scantime, deadline, scan_start, now;
 		int rc;
 
+		/* the current job is still ours unless a new one was published */
+		bool stale = !job ||
+			__atomic_load_n(&g_job_epoch, __ATOMIC_ACQUIRE) != job->epoch;
+
+		if (thr_id == 0)
+			update_active_threads();
+		if (thr_id >= __atomic_load_n(&active_threads, __ATOMIC_ACQUIRE)) {
+			job_put(job);
+			job = NULL;
+			stats_scan(thr_id, 0, 0, 0., false);
+			park_thread(thr_id);
+			continue;
+		}
+
+		scantime = (have_longpoll ? LP_SCANTIME : opt_scantime) * NSEC_PER_SEC;
 		if (have_stratum) {
-			while (time(NULL) >= g_work_time + 120)
+			while (mono_ns() >= __atomic_load_n(&g_work_time, __ATOMIC_RELAXED)
+			                    + 120 * NSEC_PER_SEC)
 				sleep(1);
-			pthread_mutex_lock(&g_work_lock);
-			if (work.data[19] >= end_nonce && !memcmp(work.data, g_work.data, 76))
-				stratum_gen_work(&stratum, &g_work);
 		} else {
-			int min_scantime = have_longpoll ? LP_SCANTIME : opt_scantime;
 			/* obtain new work from internal workio thread */
-			pthread_mutex_lock(&g_work_lock);
-			if (!have_stratum &&
-			    (time(NULL) - g_work_time >= min_scantime ||
-			     work.data[19] >= end_nonce)) {
-				if (unlikely(!get_work(mythr, &g_work))) {
-					applog(LOG_ERR, "work retrieval failed, exiting "
-						"mining thread %d", mythr->id);
-					pthread_mutex_unlock(&g_work_lock);
-					goto out;
+			if (mono_ns() - __atomic_load_n(&g_work_time, __ATOMIC_RELAXED)
+			    >= scantime || (!stale && exhausted)) {
+				pthread_mutex_lock(&g_work_lock);
+				stale = !job || g_job_epoch != job->epoch;
+				if (!have_stratum &&
+				    (mono_ns() - g_work_time >= scantime ||
+				     (!stale && exhausted))) {
+					uint64_t fetched;
+
+					if (unlikely(!get_work(mythr, &g_work, &fetched))) {
+						applog(LOG_ERR, "work retrieval failed, exiting "
+							"mining thread %d", mythr->id);
+						pthread_mutex_unlock(&g_work_lock);
+						goto out;
+					}
+					/* prefetched work has been aging already */
+					__atomic_store_n(&g_work_time,
+					                 have_stratum ? 0 : fetched,
+					                 __ATOMIC_RELAXED);
+					publish_work();
 				}
-				g_work_time = have_stratum ? 0 : time(NULL);
-			}
-			if (have_stratum) {
 				pthread_mutex_unlock(&g_work_lock);
+			}
+			if (have_stratum)
+				continue;
+		}
+		if (!job || __atomic_load_n(&g_job_epoch, __ATOMIC_ACQUIRE) != job->epoch) {
+			/* work.data is private, the rest is borrowed from the job */
+			switched = job != NULL;
+			job_put(job);
+			job = job_get();
+			if (!job) {
+				sleep(1);
 				continue;
 			}
+			work = job->work;
+			exhausted = false;
+			if (have_stratum && job->coinbase_size) {
+				/* keep counting extranonce2 while the job is the same */
+				if (strncmp(xnonce2_job, work.job_id, sizeof(xnonce2_job) - 1)) {
+					snprintf(xnonce2_job, sizeof(xnonce2_job), "%s", work.job_id);
+					xnonce2_seq = 0;
+				}
+				exhausted = true;
+			}
+		}
+		if (have_stratum && exhausted) {
+			if (prep_rings && job->coinbase_size &&
+			    work.xnonce2_len <= PREP_XNONCE2_MAX) {
+				/* the producer is normally ahead of us */
+				if (!prep_pop(thr_id, job, &work, xnonce2)) {
+					prep_wait(thr_id, job);
+					continue;
+				}
+			} else if (!stratum_thread_work(job, &work, thr_id, xnonce2_seq++,
+			                                &coinbase, &coinbase_size)) {
+				sleep(1);
+				continue;
+			}
+			__atomic_store_n(&job->ranges[thr_id].range,
+			                 nonce_range(0, NONCE_END), __ATOMIC_RELEASE);
+			exhausted = false;
 		}
-		if (memcmp(work.data, g_work.data, 76)) {
-			work_free(&work);
-			work_copy(&work, &g_work);
-			work.data[19] = 0xffffffffU / opt_n_threads * thr_id;
-		} else
-			work.data[19]++;
-		pthread_mutex_unlock(&g_work_lock);
 		work_restart[thr_id].restart = 0;
 		
-		/* adjust max_nonce to meet target scan time */
+		/* scan until the work expires, or a minute for stratum */
+		scan_start = now = mono_ns();
 		if (have_stratum)
-			max64 = LP_SCANTIME;
+			deadline = scan_start + LP_SCANTIME * NSEC_PER_SEC;
 		else
-			max64 = g_work_time + (have_longpoll ? LP_SCANTIME : opt_scantime)
-			      - time(NULL);
-		max64 *= thr_hashrates[thr_id];
-		if (max64 <= 0) {
+			deadline = __atomic_load_n(&g_work_time, __ATOMIC_RELAXED)
+			         + scantime;
+		hashes_done = 0;
+		rc = 0;
+
+		while ((now < deadline || !hashes_done) &&
+		       !work_restart[thr_id].restart &&
+		       __atomic_load_n(&g_job_epoch, __ATOMIC_ACQUIRE) == job->epoch) {
+			unsigned long slice_done = 0;
+			uint64_t slice_start;
+			int64_t slice, chunk;
+			uint32_t start, end;
+
+			/* claim about 4 seconds' worth of nonces at a time, and
+			 * scan them in slices so that the rest can be stolen */
+			if (rate) {
+				slice = scan_nonces(rate, deadline - now < slice_ns ?
+				                    deadline - now : slice_ns);
+				chunk = scan_nonces(rate, SCAN_CHUNK_NS);
+			} else
+				slice = chunk = scan_probe();
+			if (!nonce_take(job, thr_id, slice, &start, &end)) {
+				/* with stratum, the whole nonce space is ours */
+				if (!job->coinbase_size &&
+				    (nonce_claim(job, thr_id, chunk) ||
+				     nonce_steal(job, thr_id)))
+					continue;
+				exhausted = true;
+				break;
+			}
+			work.data[19] = start;
+			slice_start = now;
+			if (switched) {
+				stats_switch(thr_id, slice_start - job->publish_ns);
+				switched = false;
+			}
+
+			/* scan nonces for a proof-of-work hash */
 			switch (opt_algo) {
 			case ALGO_SCRYPT:
-				max64 = opt_scrypt_n < 16 ? 0x3ffff : 0x3fffff / opt_scrypt_n;
+				rc = scanhash_scrypt(thr_id, work.data, scratchbuf,
+				                     work.target, end - 1, &slice_done,
+				                     opt_scrypt_n);
 				break;
+
 			case ALGO_SHA256D:
-				max64 = 0x1fffff;
+				rc = scanhash_sha256d(thr_id, work.data, work.target,
+				                      end - 1, &slice_done);
 				break;
+
 			case ALGO_M7M:
-				max64 = 0x3ffff;
+				rc = scanhash_m7m_hash(thr_id, work.data, work.target,
+				                       end - 1, &slice_done);
 				break;
-			}
-		}
-		if (work.data[19] + max64 > end_nonce)
-			max_nonce = end_nonce;
-		else
-			max_nonce = work.data[19] + max64;
-		
-		hashes_done = 0;
-		gettimeofday(&tv_start, NULL);
-
-		/* scan nonces for a proof-of-work hash */
-		switch (opt_algo) {
-		case ALGO_SCRYPT:
-			rc = scanhash_scrypt(thr_id, work.data, scratchbuf, work.target,
-			                     max_nonce, &hashes_done, opt_scrypt_n);
-			break;
-
-		case ALGO_SHA256D:
-			rc = scanhash_sha256d(thr_id, work.data, work.target,
-			                      max_nonce, &hashes_done);
-			break;
-
-		case ALGO_M7M:
-			rc = scanhash_m7m_hash(thr_id, work.data, work.target,
-			                      max_nonce, &hashes_done);
-			break;
 
-		default:
-			/* should never happen */
-			goto out;
+			default:
+				/* should never happen */
+				goto out;
+			}
+			now = mono_ns();
+			hashes_done += slice_done;
+			rate = rate_update(rate, slice_done, now - slice_start);
+			if (work.data[19] + 1 < end)
+				nonce_untake(job, thr_id, work.data[19] + 1, end);
+			if (rc)
+				break;
 		}
 
-		/* record scanhash elapsed time */
-		gettimeofday(&tv_end, NULL);
-		timeval_subtract(&diff, &tv_end, &tv_start);
-		if (diff.tv_usec || diff.tv_sec) {
-			pthread_mutex_lock(&stats_lock);
-			thr_hashrates[thr_id] =
-				hashes_done / (diff.tv_sec + 1e-6 * diff.tv_usec);
-			pthread_mutex_unlock(&stats_lock);
-		}
+		if (!hashes_done)
+			continue;
+		stats_scan(thr_id, hashes_done, (now - scan_start) / 1000, rate, rc);
 		if (!opt_quiet) {
-			sprintf(s, thr_hashrates[thr_id] >= 1e6 ? "%.0f" : "%.2f",
-				1e-3 * thr_hashrates[thr_id]);
+			sprintf(s, thr_stats[thr_id].hashrate >= 1e6 ? "%.0f" : "%.2f",
+				1e-3 * thr_stats[thr_id].hashrate);
 			applog(LOG_INFO, "thread %d: %lu hashes, %s khash/s",
 				thr_id, hashes_done, s);
+			if (thr_id == active_threads - 1)
+				switch_report(now);
 		}
-		if (opt_benchmark && thr_id == opt_n_threads - 1) {
+		if (opt_benchmark && thr_id == active_threads - 1) {
+			struct thr_stats st;
 			double hashrate = 0.;
-			for (i = 0; i < opt_n_threads && thr_hashrates[i]; i++)
-				hashrate += thr_hashrates[i];
-			if (i == opt_n_threads) {
+			for (i = 0; i < active_threads; i++) {
+				stats_snapshot(i, &st);
+				if (!st.hashrate)
+					break;
+				hashrate += st.hashrate;
+			}
+			if (i == active_threads) {
 				sprintf(s, hashrate >= 1e6 ? "%.0f" : "%.2f", 1e-3 * hashrate);
 				applog(LOG_INFO, "Total: %s khash/s", s);
 			}
 		}
 
 		/* if nonce found, submit work */
-		if (rc && !opt_benchmark && !submit_work(mythr, &work))
+		if (rc && !opt_benchmark && !submit_work(mythr, &work, job))
 			break;
 	}
 
 out:
+	job_put(job);
+	free(coinbase);
 	tq_freeze(mythr->q);
 
 	return NULL;
@@ -1266,7 +3143,7 @@ static void *longpoll_thread(void *userdata)
 	char *copy_start, *hdr_path = NULL, *lp_url = NULL;
 	bool need_slash = false;
 
-	curl = curl_easy_init();
+	curl = json_rpc_handle();
 	if (unlikely(!curl)) {
 		applog(LOG_ERR, "CURL initialization failed");
 		goto out;
@@ -1304,8 +3181,11 @@ start:
 		int err;
 
 		if (have_gbt) {
+			pthread_mutex_lock(&lp_id_lock);
 			req = malloc(strlen(gbt_lp_req) + strlen(lp_id) + 1);
-			sprintf(req, gbt_lp_req, lp_id);
+			if (req)
+				sprintf(req, gbt_lp_req, lp_id);
+			pthread_mutex_unlock(&lp_id_lock);
 		}
 		val = json_rpc_call(curl, lp_url, rpc_userpass,
 				    req ? req : getwork_req, &err,
@@ -1317,30 +3197,42 @@ start:
 			goto out;
 		}
 		if (likely(val)) {
+			struct work work;
 			bool rc;
 			applog(LOG_INFO, "LONGPOLL pushed new work");
 			res = json_object_get(val, "result");
 			soval = json_object_get(res, "submitold");
 			submit_old = soval ? json_is_true(soval) : false;
-			pthread_mutex_lock(&g_work_lock);
+			/* decode without holding up the miners */
+			memset(&work, 0, sizeof(work));
 			if (have_gbt)
-				rc = gbt_work_decode(res, &g_work);
+				rc = gbt_work_decode(res, &work);
 			else
-				rc = work_decode(res, &g_work);
+				rc = work_decode(res, &work);
+			pthread_mutex_lock(&g_work_lock);
 			if (rc) {
-				time(&g_work_time);
+				work_free(&g_work);
+				memcpy(&g_work, &work, sizeof(work));
+				__atomic_store_n(&g_work_time, mono_ns(), __ATOMIC_RELAXED);
+				publish_work();
+				prefetch_flush();
 				restart_threads();
-			}
+			} else
+				work_free(&work);
 			pthread_mutex_unlock(&g_work_lock);
 			json_decref(val);
 		} else {
 			pthread_mutex_lock(&g_work_lock);
-			g_work_time -= LP_SCANTIME;
+			__atomic_store_n(&g_work_time, g_work_time > LP_SCANTIME * NSEC_PER_SEC ?
+			                 g_work_time - LP_SCANTIME * NSEC_PER_SEC : 0,
+			                 __ATOMIC_RELAXED);
 			pthread_mutex_unlock(&g_work_lock);
 			if (err == CURLE_OPERATION_TIMEDOUT) {
 				restart_threads();
 			} else {
+				pthread_mutex_lock(&lp_id_lock);
 				have_longpoll = false;
+				pthread_mutex_unlock(&lp_id_lock);
 				restart_threads();
 				free(hdr_path);
 				free(lp_url);
@@ -1361,7 +3253,7 @@ out:
 	return NULL;
 }
 
-static bool stratum_handle_response(char *buf)
+static bool stratum_handle_response(const char *buf)
 {
 	json_t *val, *err_val, *res_val, *id_val;
 	json_error_t err;
@@ -1381,7 +3273,9 @@ static bool stratum_handle_response(char *buf)
 		goto out;
 
 	share_result(json_is_true(res_val),
-		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL);
+		err_val ? json_string_value(json_array_get(err_val, 1)) : NULL,
+		json_is_integer(id_val) ?
+			(int)json_integer_value(id_val) - STRATUM_SUBMIT_ID : -1);
 
 	ret = true;
 out:
@@ -1394,7 +3288,7 @@ out:
 static void *stratum_thread(void *userdata)
 {
 	struct thr_info *mythr = userdata;
-	char *s;
+	const char *s;
 
 	stratum.url = tq_pop(mythr->q, NULL);
 	if (!stratum.url)
@@ -1406,7 +3300,7 @@ static void *stratum_thread(void *userdata)
 
 		while (!stratum.curl) {
 			pthread_mutex_lock(&g_work_lock);
-			g_work_time = 0;
+			__atomic_store_n(&g_work_time, 0, __ATOMIC_RELAXED);
 			pthread_mutex_unlock(&g_work_lock);
 			restart_threads();
 
@@ -1416,7 +3310,7 @@ static void *stratum_thread(void *userdata)
 				stratum_disconnect(&stratum);
 				if (opt_retries >= 0 && ++failures > opt_retries) {
 					applog(LOG_ERR, "...terminating workio thread");
-					tq_push(thr_info[work_thr_id].q, NULL);
+					tq_push(thr_info[work_thr_id].q, &workio_quit);
 					goto out;
 				}
 				applog(LOG_ERR, "...retry after %d seconds", opt_fail_pause);
@@ -1428,7 +3322,8 @@ static void *stratum_thread(void *userdata)
 		    (!g_work_time || strcmp(stratum.job.job_id, g_work.job_id))) {
 			pthread_mutex_lock(&g_work_lock);
 			stratum_gen_work(&stratum, &g_work);
-			time(&g_work_time);
+			__atomic_store_n(&g_work_time, mono_ns(), __ATOMIC_RELAXED);
+			publish_work();
 			pthread_mutex_unlock(&g_work_lock);
 			if (stratum.job.clean) {
 				applog(LOG_INFO, "Stratum requested work restart");
@@ -1440,7 +3335,7 @@ static void *stratum_thread(void *userdata)
 			applog(LOG_ERR, "Stratum connection timed out");
 			s = NULL;
 		} else
-			s = stratum_recv_line(&stratum);
+			s = stratum_recv_line(&stratum, NULL);
 		if (!s) {
 			stratum_disconnect(&stratum);
 			applog(LOG_ERR, "Stratum connection interrupted");
@@ -1448,7 +3343,6 @@ static void *stratum_thread(void *userdata)
 		}
 		if (!stratum_handle_method(&stratum, s))
 			stratum_handle_response(s);
-		free(s);
 	}
 
 out:
@@ -1473,6 +3367,9 @@ static void show_version_and_exit(void)
 #if defined(__x86_64__) && defined(USE_AVX2)
 		" AVX2"
 #endif
+#if defined(__x86_64__) && defined(USE_AVX512)
+		" AVX512"
+#endif
 #if defined(__x86_64__) && defined(USE_XOP)
 		" XOP"
 #endif
@@ -1739,6 +3636,44 @@ static void parse_arg(int key, char *arg, char *pname)
 		}
 		strcpy(coinbase_sig, arg);
 		break;
+	case 1017:			/* --scrypt-tmto */
+		if (!strcmp(arg, "auto")) {
+			opt_scrypt_tmto = -1;
+			break;
+		}
+		v = atoi(arg);
+		if (v < 1 || v > 65536 || v & (v-1))	/* sanity check */
+			show_usage_and_exit(1);
+		opt_scrypt_tmto = v > 1 ? v : 0;
+		break;
+	case 1019:			/* --no-scrypt-tune */
+		opt_scrypt_tune = false;
+		break;
+	case 1023:			/* --switch-latency */
+		v = atoi(arg);
+		if (v < 1 || v > 60000)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_switch_latency = v;
+		break;
+	case 1025:			/* --prefetch */
+		v = atoi(arg);
+		if (v < 0 || v > PREFETCH_MAX)	/* sanity check */
+			show_usage_and_exit(1);
+		opt_prefetch = v;
+		break;
+	case 1021:			/* --placement */
+		for (i = 0; i < ARRAY_SIZE(placement_names); i++) {
+			if (!strcmp(arg, placement_names[i])) {
+				opt_placement = i;
+				break;
+			}
+		}
+		if (i == ARRAY_SIZE(placement_names)) {
+			fprintf(stderr, "%s: unknown placement policy -- '%s'\n",
+				pname, arg);
+			show_usage_and_exit(1);
+		}
+		break;
 	case 'S':
 		use_syslog = true;
 		break;
@@ -1852,8 +3787,13 @@ int main(int argc, char *argv[])
 	}
 
 	pthread_mutex_init(&applog_lock, NULL);
-	pthread_mutex_init(&stats_lock, NULL);
 	pthread_mutex_init(&g_work_lock, NULL);
+	pthread_mutex_init(&prep_lock, NULL);
+	pthread_cond_init(&prep_cond, NULL);
+	pthread_mutex_init(&park_lock, NULL);
+	pthread_mutex_init(&prefetch_lock, NULL);
+	pthread_mutex_init(&lp_id_lock, NULL);
+	pthread_cond_init(&park_cond, NULL);
 	pthread_mutex_init(&stratum.sock_lock, NULL);
 	pthread_mutex_init(&stratum.work_lock, NULL);
 
@@ -1895,28 +3835,78 @@ int main(int argc, char *argv[])
 #else
 	num_processors = 1;
 #endif
+	/* we may be confined to a subset of the processors */
+	i = cpus_allowed();
+	if (i > 0 && i < num_processors)
+		num_processors = i;
 	if (num_processors < 1)
 		num_processors = 1;
-	if (!opt_n_threads)
+	if (!opt_n_threads) {
 		opt_n_threads = num_processors;
+		auto_threads = true;
+	}
+	/* threads beyond the CPU quota are started, but kept parked */
+	active_threads = opt_n_threads;
+	i = auto_threads ? cpu_quota() : 0;
+	if (i && i < opt_n_threads) {
+		active_threads = i;
+		applog(LOG_INFO, "CPU quota allows %d of %d processors",
+		       active_threads, opt_n_threads);
+	}
+
+	if (opt_algo == ALGO_SCRYPT) {
+		if (opt_scrypt_tmto < 0)
+			opt_scrypt_tmto = scrypt_tmto_auto(opt_scrypt_n, active_threads);
+		if (opt_scrypt_tmto > opt_scrypt_n)
+			opt_scrypt_tmto = opt_scrypt_n;
+		if (!opt_scrypt_tmto && opt_scrypt_tune)
+			scrypt_autotune(opt_scrypt_n, active_threads);
+	} else
+		opt_scrypt_tmto = 0;
 
 #ifdef HAVE_SYSLOG_H
 	if (use_syslog)
 		openlog("cpuminer", LOG_PID, LOG_USER);
 #endif
 
+	/*
+	 * one slot per miner thread and per pending share, one held by
+	 * prep_thread, one for g_job and one being published
+	 */
+	num_jobs = opt_n_threads * (1 + SHARE_SLOTS) + 3;
+	jobs = calloc(num_jobs, sizeof(*jobs));
+	if (!jobs)
+		return 1;
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].free = 1;
+		jobs[i].ranges = calloc(opt_n_threads, sizeof(*jobs[i].ranges));
+		if (!jobs[i].ranges)
+			return 1;
+	}
+
 	work_restart = calloc(opt_n_threads, sizeof(*work_restart));
 	if (!work_restart)
 		return 1;
 
-	thr_info = calloc(opt_n_threads + 3, sizeof(*thr));
+	thr_info = calloc(opt_n_threads + 4, sizeof(*thr));
 	if (!thr_info)
 		return 1;
 	
-	thr_hashrates = (double *) calloc(opt_n_threads, sizeof(double));
-	if (!thr_hashrates)
+	thr_stats = calloc_aligned(opt_n_threads, sizeof(*thr_stats));
+	if (!thr_stats)
+		return 1;
+	switch_stats = calloc_aligned(opt_n_threads, sizeof(*switch_stats));
+	if (!switch_stats)
+		return 1;
+	shares = calloc_aligned(opt_n_threads * SHARE_SLOTS, sizeof(*shares));
+	if (!shares)
 		return 1;
 
+	thr_cpu = calloc(opt_n_threads, sizeof(*thr_cpu));
+	if (!thr_cpu)
+		return 1;
+	plan_placement();
+
 	/* init workio thread info */
 	work_thr_id = opt_n_threads;
 	thr = &thr_info[work_thr_id];
@@ -1963,6 +3953,24 @@ int main(int argc, char *argv[])
 
 		if (have_stratum)
 			tq_push(thr_info[stratum_thr_id].q, strdup(rpc_url));
+
+		/* init header preparation thread info */
+		prep_rings = calloc_aligned(opt_n_threads, sizeof(*prep_rings));
+		if (!prep_rings)
+			return 1;
+		for (i = 0; i < opt_n_threads; i++) {
+			pthread_mutex_init(&prep_rings[i].lock, NULL);
+			pthread_cond_init(&prep_rings[i].cond, NULL);
+		}
+		prep_thr_id = opt_n_threads + 3;
+		thr = &thr_info[prep_thr_id];
+		thr->id = prep_thr_id;
+
+		/* start header preparation thread */
+		if (unlikely(pthread_create(&thr->pth, NULL, prep_thread, thr))) {
+			applog(LOG_ERR, "header preparation thread create failed");
+			return 1;
+		}
 	}
 
 	/* start mining threads */
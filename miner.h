@@ -135,6 +135,10 @@ static inline void le32enc(void *pp, uint32_t x)
 void sha256_init(uint32_t *state);
 void sha256_transform(uint32_t *state, const uint32_t *block, int swap);
 void sha256d(unsigned char *hash, const unsigned char *data, int len);
+void sha256d_resume(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total);
+void sha256d_resume_multi(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total, int n);
 
 #ifdef USE_ASM
 #if defined(__ARM_NEON__) || defined(__i386__) || defined(__x86_64__)
@@ -155,6 +159,8 @@ extern int scanhash_sha256d(int thr_id, uint32_t *pdata,
 	const uint32_t *ptarget, uint32_t max_nonce, unsigned long *hashes_done);
 
 extern unsigned char *scrypt_buffer_alloc(int N);
+extern int scrypt_tmto_auto(int N, int threads);
+extern void scrypt_autotune(int N, int threads);
 extern int scanhash_scrypt(int thr_id, uint32_t *pdata,
 	unsigned char *scratchbuf, const uint32_t *ptarget,
 	uint32_t max_nonce, unsigned long *hashes_done, int N);
@@ -177,6 +183,7 @@ extern bool opt_debug;
 extern bool opt_protocol;
 extern bool opt_redirect;
 extern int opt_timeout;
+extern int opt_scrypt_tmto;
 extern bool want_longpoll;
 extern bool have_longpoll;
 extern bool have_gbt;
@@ -197,26 +204,42 @@ extern struct work_restart *work_restart;
 #define JSON_RPC_QUIET_404	(1 << 1)
 
 extern void applog(int prio, const char *fmt, ...);
+struct rpc_iov {
+	const void *buf;
+	size_t len;
+};
+
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 	const char *rpc_req, int *curl_err, int flags);
+extern json_t *json_rpc_call_iov(CURL *curl, const char *url,
+	const char *userpass, const struct rpc_iov *iov, int iovcnt,
+	int *curl_err, int flags);
+struct rpc_req;
+extern CURL *json_rpc_handle(void);
+extern struct rpc_req *json_rpc_begin(CURL *curl, const char *url,
+	const char *userpass, const struct rpc_iov *iov, int iovcnt, int flags);
+extern json_t *json_rpc_end(struct rpc_req *req, CURLcode rc, int *curl_err);
 extern void bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *abin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
+extern bool hex2bin_len(unsigned char *p, const char *hexstr, size_t hexlen);
 extern int varint_encode(unsigned char *p, uint64_t n);
 extern size_t address_to_script(unsigned char *out, size_t outsz, const char *addr);
 extern int timeval_subtract(struct timeval *result, struct timeval *x,
 	struct timeval *y);
 extern bool fulltest(const uint32_t *hash, const uint32_t *target);
+extern int cpu_node(int cpu);
 extern void diff_to_target(uint32_t *target, double diff);
 
 struct stratum_job {
 	char *job_id;
+	size_t job_id_alloc;
 	unsigned char prevhash[32];
-	size_t coinbase_size;
+	size_t coinbase_size, coinbase_alloc;
 	unsigned char *coinbase;
 	unsigned char *xnonce2;
-	int merkle_count;
-	unsigned char **merkle;
+	int merkle_count, merkle_alloc;
+	unsigned char (*merkle)[32];
 	unsigned char version[4];
 	unsigned char nbits[4];
 	unsigned char ntime[4];
@@ -232,7 +255,12 @@ struct stratum_ctx {
 	char curl_err_str[CURL_ERROR_SIZE];
 	curl_socket_t sock;
 	size_t sockbuf_size;
+	size_t sockbuf_head, sockbuf_scan, sockbuf_tail;
 	char *sockbuf;
+	size_t sendbuf_size, sendbuf_len;
+	char *sendbuf;		/* output not yet accepted by the socket */
+	int epfd;
+	bool want_out;		/* epfd also waits for the socket to be writable */
 	pthread_mutex_t sock_lock;
 
 	double next_diff;
@@ -247,7 +275,7 @@ struct stratum_ctx {
 
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout);
 bool stratum_send_line(struct stratum_ctx *sctx, char *s);
-char *stratum_recv_line(struct stratum_ctx *sctx);
+const char *stratum_recv_line(struct stratum_ctx *sctx, size_t *len);
 bool stratum_connect(struct stratum_ctx *sctx, const char *url);
 void stratum_disconnect(struct stratum_ctx *sctx);
 bool stratum_subscribe(struct stratum_ctx *sctx);
@@ -30,11 +30,24 @@
 
 					
 #include "cpuminer-config.h"
+#define _GNU_SOURCE
 #include "miner.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <unistd.h>
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <cpuid.h>
+#endif
+#include "compat.h"
+#ifdef __linux__
+#include <errno.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 static const uint32_t keypad[12] = {
     0x80000000, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00000280
@@ -73,3 +86,1319 @@ static inline void HMAC_SHA256_80_init(const uint32_t *key, uint32_t*tstate, uin
         pad[i] = 0x36363636;
     sha256_transform(tstate, pad, 0);
 }
+
+static inline void PBKDF2_SHA256_80_128(const uint32_t *tstate,
+	const uint32_t *ostate, const uint32_t *salt, uint32_t *output)
+{
+	uint32_t istate[8], ostate2[8];
+	uint32_t ibuf[16], obuf[16];
+	int i, j;
+
+	memcpy(istate, tstate, 32);
+	sha256_transform(istate, salt, 0);
+	
+	memcpy(ibuf, salt + 16, 16);
+	memcpy(ibuf + 5, innerpad, 44);
+	memcpy(obuf + 8, outerpad, 32);
+
+	for (i = 0; i < 4; i++) {
+		memcpy(obuf, istate, 32);
+		ibuf[4] = i + 1;
+		sha256_transform(obuf, ibuf, 0);
+
+		memcpy(ostate2, ostate, 32);
+		sha256_transform(ostate2, obuf, 0);
+		for (j = 0; j < 8; j++)
+			output[8 * i + j] = swab32(ostate2[j]);
+	}
+}
+
+static inline void PBKDF2_SHA256_128_32(uint32_t *tstate, uint32_t *ostate,
+	const uint32_t *salt, uint32_t *output)
+{
+	uint32_t buf[16];
+	int i;
+	
+	sha256_transform(tstate, salt, 1);
+	sha256_transform(tstate, salt + 16, 1);
+	sha256_transform(tstate, finalblk, 0);
+	memcpy(buf, tstate, 32);
+	memcpy(buf + 8, outerpad, 32);
+
+	sha256_transform(ostate, buf, 0);
+	for (i = 0; i < 8; i++)
+		output[i] = swab32(ostate[i]);
+}
+
+
+#ifdef HAVE_SHA256_4WAY
+
+static const uint32_t keypad_4way[4 * 12] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000280, 0x00000280, 0x00000280, 0x00000280
+};
+static const uint32_t innerpad_4way[4 * 11] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0
+};
+static const uint32_t outerpad_4way[4 * 8] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000300, 0x00000300, 0x00000300, 0x00000300
+};
+static const uint32_t finalblk_4way[4 * 16] __attribute__((aligned(16))) = {
+	0x00000001, 0x00000001, 0x00000001, 0x00000001,
+	0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000620, 0x00000620, 0x00000620, 0x00000620
+};
+
+static inline void HMAC_SHA256_80_init_4way(const uint32_t *key,
+	uint32_t *tstate, uint32_t *ostate)
+{
+	uint32_t ihash[4 * 8] __attribute__((aligned(16)));
+	uint32_t pad[4 * 16] __attribute__((aligned(16)));
+	int i;
+	
+	/* tstate is assumed to contain the midstate of key */
+	memcpy(pad, key + 4 * 16, 4 * 16);
+	memcpy(pad + 4 * 4, keypad_4way, 4 * 48);
+	sha256_transform_4way(tstate, pad, 0);
+	memcpy(ihash, tstate, 4 * 32);
+	
+	sha256_init_4way(ostate);
+	for (i = 0; i < 4 * 8; i++)
+		pad[i] = ihash[i] ^ 0x5c5c5c5c;
+	for (; i < 4 * 16; i++)
+		pad[i] = 0x5c5c5c5c;
+	sha256_transform_4way(ostate, pad, 0);
+	
+	sha256_init_4way(tstate);
+	for (i = 0; i < 4 * 8; i++)
+		pad[i] = ihash[i] ^ 0x36363636;
+	for (; i < 4 * 16; i++)
+		pad[i] = 0x36363636;
+	sha256_transform_4way(tstate, pad, 0);
+}
+
+static inline void PBKDF2_SHA256_80_128_4way(const uint32_t *tstate,
+	const uint32_t *ostate, const uint32_t *salt, uint32_t *output)
+{
+	uint32_t istate[4 * 8] __attribute__((aligned(16)));
+	uint32_t ostate2[4 * 8] __attribute__((aligned(16)));
+	uint32_t ibuf[4 * 16] __attribute__((aligned(16)));
+	uint32_t obuf[4 * 16] __attribute__((aligned(16)));
+	int i, j;
+	
+	memcpy(istate, tstate, 4 * 32);
+	sha256_transform_4way(istate, salt, 0);
+	
+	memcpy(ibuf, salt + 4 * 16, 4 * 16);
+	memcpy(ibuf + 4 * 5, innerpad_4way, 4 * 44);
+	memcpy(obuf + 4 * 8, outerpad_4way, 4 * 32);
+	
+	for (i = 0; i < 4; i++) {
+		memcpy(obuf, istate, 4 * 32);
+		for (j = 0; j < 4; j++)
+			ibuf[4 * 4 + j] = i + 1;
+		sha256_transform_4way(obuf, ibuf, 0);
+		
+		memcpy(ostate2, ostate, 4 * 32);
+		sha256_transform_4way(ostate2, obuf, 0);
+		for (j = 0; j < 4 * 8; j++)
+			output[4 * 8 * i + j] = swab32(ostate2[j]);
+	}
+}
+
+static inline void PBKDF2_SHA256_128_32_4way(uint32_t *tstate,
+	uint32_t *ostate, const uint32_t *salt, uint32_t *output)
+{
+	uint32_t buf[4 * 16] __attribute__((aligned(16)));
+	int i;
+	
+	sha256_transform_4way(tstate, salt, 1);
+	sha256_transform_4way(tstate, salt + 4 * 16, 1);
+	sha256_transform_4way(tstate, finalblk_4way, 0);
+	
+	memcpy(buf, tstate, 4 * 32);
+	memcpy(buf + 4 * 8, outerpad_4way, 4 * 32);
+	
+	sha256_transform_4way(ostate, buf, 0);
+	for (i = 0; i < 4 * 8; i++)
+		output[i] = swab32(ostate[i]);
+}
+
+#endif /* HAVE_SHA256_4WAY */
+
+#ifdef HAVE_SHA256_8WAY
+
+static const uint32_t keypad_8way[8 * 12] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000280, 0x00000280, 0x00000280, 0x00000280, 0x00000280, 0x00000280, 0x00000280, 0x00000280
+};
+static const uint32_t innerpad_8way[8 * 11] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0, 0x000004a0
+};
+static const uint32_t outerpad_8way[8 * 8] = {
+	0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000300, 0x00000300, 0x00000300, 0x00000300, 0x00000300, 0x00000300, 0x00000300, 0x00000300
+};
+static const uint32_t finalblk_8way[8 * 16] __attribute__((aligned(32))) = {
+	0x00000001, 0x00000001, 0x00000001, 0x00000001, 0x00000001, 0x00000001, 0x00000001, 0x00000001,
+	0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000, 0x80000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+	0x00000620, 0x00000620, 0x00000620, 0x00000620, 0x00000620, 0x00000620, 0x00000620, 0x00000620
+};
+
+static inline void HMAC_SHA256_80_init_8way(const uint32_t *key,
+	uint32_t *tstate, uint32_t *ostate)
+{
+	uint32_t ihash[8 * 8] __attribute__((aligned(32)));
+	uint32_t pad[8 * 16] __attribute__((aligned(32)));
+	int i;
+	
+	/* tstate is assumed to contain the midstate of key */
+	memcpy(pad, key + 8 * 16, 8 * 16);
+	memcpy(pad + 8 * 4, keypad_8way, 8 * 48);
+	sha256_transform_8way(tstate, pad, 0);
+	memcpy(ihash, tstate, 8 * 32);
+	
+	sha256_init_8way(ostate);
+	for (i = 0; i < 8 * 8; i++)
+		pad[i] = ihash[i] ^ 0x5c5c5c5c;
+	for (; i < 8 * 16; i++)
+		pad[i] = 0x5c5c5c5c;
+	sha256_transform_8way(ostate, pad, 0);
+	
+	sha256_init_8way(tstate);
+	for (i = 0; i < 8 * 8; i++)
+		pad[i] = ihash[i] ^ 0x36363636;
+	for (; i < 8 * 16; i++)
+		pad[i] = 0x36363636;
+	sha256_transform_8way(tstate, pad, 0);
+}
+
+static inline void PBKDF2_SHA256_80_128_8way(const uint32_t *tstate,
+	const uint32_t *ostate, const uint32_t *salt, uint32_t *output)
+{
+	uint32_t istate[8 * 8] __attribute__((aligned(32)));
+	uint32_t ostate2[8 * 8] __attribute__((aligned(32)));
+	uint32_t ibuf[8 * 16] __attribute__((aligned(32)));
+	uint32_t obuf[8 * 16] __attribute__((aligned(32)));
+	int i, j;
+	
+	memcpy(istate, tstate, 8 * 32);
+	sha256_transform_8way(istate, salt, 0);
+	
+	memcpy(ibuf, salt + 8 * 16, 8 * 16);
+	memcpy(ibuf + 8 * 5, innerpad_8way, 8 * 44);
+	memcpy(obuf + 8 * 8, outerpad_8way, 8 * 32);
+	
+	for (i = 0; i < 4; i++) {
+		memcpy(obuf, istate, 8 * 32);
+		for (j = 0; j < 8; j++)
+			ibuf[8 * 4 + j] = i + 1;
+		sha256_transform_8way(obuf, ibuf, 0);
+		
+		memcpy(ostate2, ostate, 8 * 32);
+		sha256_transform_8way(ostate2, obuf, 0);
+		for (j = 0; j < 8 * 8; j++)
+			output[8 * 8 * i + j] = swab32(ostate2[j]);
+	}
+}
+
+static inline void PBKDF2_SHA256_128_32_8way(uint32_t *tstate,
+	uint32_t *ostate, const uint32_t *salt, uint32_t *output)
+{
+	uint32_t buf[8 * 16] __attribute__((aligned(32)));
+	int i;
+	
+	sha256_transform_8way(tstate, salt, 1);
+	sha256_transform_8way(tstate, salt + 8 * 16, 1);
+	sha256_transform_8way(tstate, finalblk_8way, 0);
+	
+	memcpy(buf, tstate, 8 * 32);
+	memcpy(buf + 8 * 8, outerpad_8way, 8 * 32);
+	
+	sha256_transform_8way(ostate, buf, 0);
+	for (i = 0; i < 8 * 8; i++)
+		output[i] = swab32(ostate[i]);
+}
+
+#endif /* HAVE_SHA256_8WAY */
+
+
+#if defined(USE_ASM) && defined(__x86_64__)
+
+#define SCRYPT_MAX_WAYS 3
+#define HAVE_SCRYPT_3WAY 1
+int scrypt_best_throughput();
+void scrypt_core(uint32_t *X, uint32_t *V, int N);
+void scrypt_core_3way(uint32_t *X, uint32_t *V, int N);
+#if defined(USE_AVX2)
+#undef SCRYPT_MAX_WAYS
+#define SCRYPT_MAX_WAYS 6
+#define HAVE_SCRYPT_6WAY 1
+void scrypt_core_6way(uint32_t *X, uint32_t *V, int N);
+#endif
+#if defined(USE_AVX512) && defined(HAVE_SHA256_8WAY)
+#undef SCRYPT_MAX_WAYS
+#define SCRYPT_MAX_WAYS 16
+#define HAVE_SCRYPT_16WAY 1
+void scrypt_core_16way(uint32_t *X, uint32_t *V, int N);
+#endif
+
+#elif defined(USE_ASM) && defined(__i386__)
+
+#define SCRYPT_MAX_WAYS 1
+#define scrypt_best_throughput() 1
+void scrypt_core(uint32_t *X, uint32_t *V, int N);
+
+#elif defined(USE_ASM) && defined(__arm__) && defined(__APCS_32__)
+
+void scrypt_core(uint32_t *X, uint32_t *V, int N);
+#if defined(__ARM_NEON__)
+#define SCRYPT_MAX_WAYS 3
+#define HAVE_SCRYPT_3WAY 1
+#define scrypt_best_throughput() 3
+void scrypt_core_3way(uint32_t *X, uint32_t *V, int N);
+#endif
+
+#else
+
+static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
+{
+	uint32_t x00,x01,x02,x03,x04,x05,x06,x07,x08,x09,x10,x11,x12,x13,x14,x15;
+	int i;
+
+	x00 = (B[ 0] ^= Bx[ 0]);
+	x01 = (B[ 1] ^= Bx[ 1]);
+	x02 = (B[ 2] ^= Bx[ 2]);
+	x03 = (B[ 3] ^= Bx[ 3]);
+	x04 = (B[ 4] ^= Bx[ 4]);
+	x05 = (B[ 5] ^= Bx[ 5]);
+	x06 = (B[ 6] ^= Bx[ 6]);
+	x07 = (B[ 7] ^= Bx[ 7]);
+	x08 = (B[ 8] ^= Bx[ 8]);
+	x09 = (B[ 9] ^= Bx[ 9]);
+	x10 = (B[10] ^= Bx[10]);
+	x11 = (B[11] ^= Bx[11]);
+	x12 = (B[12] ^= Bx[12]);
+	x13 = (B[13] ^= Bx[13]);
+	x14 = (B[14] ^= Bx[14]);
+	x15 = (B[15] ^= Bx[15]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+		/* Operate on columns. */
+		x04 ^= R(x00+x12, 7);	x09 ^= R(x05+x01, 7);
+		x14 ^= R(x10+x06, 7);	x03 ^= R(x15+x11, 7);
+		
+		x08 ^= R(x04+x00, 9);	x13 ^= R(x09+x05, 9);
+		x02 ^= R(x14+x10, 9);	x07 ^= R(x03+x15, 9);
+		
+		x12 ^= R(x08+x04,13);	x01 ^= R(x13+x09,13);
+		x06 ^= R(x02+x14,13);	x11 ^= R(x07+x03,13);
+		
+		x00 ^= R(x12+x08,18);	x05 ^= R(x01+x13,18);
+		x10 ^= R(x06+x02,18);	x15 ^= R(x11+x07,18);
+		
+		/* Operate on rows. */
+		x01 ^= R(x00+x03, 7);	x06 ^= R(x05+x04, 7);
+		x11 ^= R(x10+x09, 7);	x12 ^= R(x15+x14, 7);
+		
+		x02 ^= R(x01+x00, 9);	x07 ^= R(x06+x05, 9);
+		x08 ^= R(x11+x10, 9);	x13 ^= R(x12+x15, 9);
+		
+		x03 ^= R(x02+x01,13);	x04 ^= R(x07+x06,13);
+		x09 ^= R(x08+x11,13);	x14 ^= R(x13+x12,13);
+		
+		x00 ^= R(x03+x02,18);	x05 ^= R(x04+x07,18);
+		x10 ^= R(x09+x08,18);	x15 ^= R(x14+x13,18);
+#undef R
+	}
+	B[ 0] += x00;
+	B[ 1] += x01;
+	B[ 2] += x02;
+	B[ 3] += x03;
+	B[ 4] += x04;
+	B[ 5] += x05;
+	B[ 6] += x06;
+	B[ 7] += x07;
+	B[ 8] += x08;
+	B[ 9] += x09;
+	B[10] += x10;
+	B[11] += x11;
+	B[12] += x12;
+	B[13] += x13;
+	B[14] += x14;
+	B[15] += x15;
+}
+
+static inline void scrypt_core(uint32_t *X, uint32_t *V, int N)
+{
+	uint32_t i, j, k;
+	
+	for (i = 0; i < N; i++) {
+		memcpy(&V[i * 32], X, 128);
+		xor_salsa8(&X[0], &X[16]);
+		xor_salsa8(&X[16], &X[0]);
+	}
+	for (i = 0; i < N; i++) {
+		j = 32 * (X[16] & (N - 1));
+		for (k = 0; k < 32; k++)
+			X[k] ^= V[j + k];
+		xor_salsa8(&X[0], &X[16]);
+		xor_salsa8(&X[16], &X[0]);
+	}
+}
+
+#endif
+
+#ifndef SCRYPT_MAX_WAYS
+#define SCRYPT_MAX_WAYS 1
+#define scrypt_best_throughput() 1
+#endif
+
+/* Batches of several ROMix calls that share multi-buffer PBKDF2 stages. */
+#if defined(HAVE_SCRYPT_3WAY) && defined(HAVE_SHA256_4WAY)
+#define HAVE_SCRYPT_12WAY 1
+#endif
+#if defined(HAVE_SCRYPT_6WAY) && defined(HAVE_SHA256_8WAY)
+#define HAVE_SCRYPT_24WAY 1
+#endif
+#define SCRYPT_MAX_BATCH 24
+
+#if defined(__GNUC__)
+
+/*
+ * Time-memory trade-off: only every gap-th entry of V is stored, and
+ * the missing ones are recomputed from the nearest stored entry during
+ * the second loop.  Lanes are kept in a word-sliced layout so that the
+ * recomputation can be done in lockstep with GCC vector extensions.
+ */
+#define HAVE_SCRYPT_TMTO 1
+#define SCRYPT_TMTO_WAYS 8
+
+typedef uint32_t scrypt_tmto_vec
+	__attribute__((vector_size(4 * SCRYPT_TMTO_WAYS)));
+
+static inline void xor_salsa8_tmto(scrypt_tmto_vec B[16],
+	const scrypt_tmto_vec Bx[16])
+{
+	scrypt_tmto_vec x[16];
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = (B[i] ^= Bx[i]);
+	for (i = 0; i < 8; i += 2) {
+#define R(a, b) (((a) << (b)) | ((a) >> (32 - (b))))
+		/* Operate on columns. */
+		x[ 4] ^= R(x[ 0]+x[12], 7);	x[ 9] ^= R(x[ 5]+x[ 1], 7);
+		x[14] ^= R(x[10]+x[ 6], 7);	x[ 3] ^= R(x[15]+x[11], 7);
+
+		x[ 8] ^= R(x[ 4]+x[ 0], 9);	x[13] ^= R(x[ 9]+x[ 5], 9);
+		x[ 2] ^= R(x[14]+x[10], 9);	x[ 7] ^= R(x[ 3]+x[15], 9);
+
+		x[12] ^= R(x[ 8]+x[ 4],13);	x[ 1] ^= R(x[13]+x[ 9],13);
+		x[ 6] ^= R(x[ 2]+x[14],13);	x[11] ^= R(x[ 7]+x[ 3],13);
+
+		x[ 0] ^= R(x[12]+x[ 8],18);	x[ 5] ^= R(x[ 1]+x[13],18);
+		x[10] ^= R(x[ 6]+x[ 2],18);	x[15] ^= R(x[11]+x[ 7],18);
+
+		/* Operate on rows. */
+		x[ 1] ^= R(x[ 0]+x[ 3], 7);	x[ 6] ^= R(x[ 5]+x[ 4], 7);
+		x[11] ^= R(x[10]+x[ 9], 7);	x[12] ^= R(x[15]+x[14], 7);
+
+		x[ 2] ^= R(x[ 1]+x[ 0], 9);	x[ 7] ^= R(x[ 6]+x[ 5], 9);
+		x[ 8] ^= R(x[11]+x[10], 9);	x[13] ^= R(x[12]+x[15], 9);
+
+		x[ 3] ^= R(x[ 2]+x[ 1],13);	x[ 4] ^= R(x[ 7]+x[ 6],13);
+		x[ 9] ^= R(x[ 8]+x[11],13);	x[14] ^= R(x[13]+x[12],13);
+
+		x[ 0] ^= R(x[ 3]+x[ 2],18);	x[ 5] ^= R(x[ 4]+x[ 7],18);
+		x[10] ^= R(x[ 9]+x[ 8],18);	x[15] ^= R(x[14]+x[13],18);
+#undef R
+	}
+	for (i = 0; i < 16; i++)
+		B[i] += x[i];
+}
+
+/* X holds word w of lane l at X[w * SCRYPT_TMTO_WAYS + l]. */
+static void scrypt_core_tmto(uint32_t *X, uint32_t *V, int N, int gap)
+{
+	scrypt_tmto_vec *Xv = (scrypt_tmto_vec *)X;
+	scrypt_tmto_vec *Vv = (scrypt_tmto_vec *)V;
+	scrypt_tmto_vec Z[32], T[32], mv, mask;
+	uint32_t e[SCRYPT_TMTO_WAYS], m[SCRYPT_TMTO_WAYS], steps;
+	int i, k, l;
+
+	for (i = 0; i < N; i++) {
+		if (i % gap == 0)
+			memcpy(&Vv[(i / gap) * 32], Xv, sizeof(Z));
+		xor_salsa8_tmto(&Xv[0], &Xv[16]);
+		xor_salsa8_tmto(&Xv[16], &Xv[0]);
+	}
+	for (i = 0; i < N; i++) {
+		steps = 0;
+		for (l = 0; l < SCRYPT_TMTO_WAYS; l++) {
+			uint32_t j = Xv[16][l] & (N - 1);
+			e[l] = j / gap;
+			m[l] = j % gap;
+			if (m[l] > steps)
+				steps = m[l];
+		}
+		for (k = 0; k < 32; k++)
+			for (l = 0; l < SCRYPT_TMTO_WAYS; l++)
+				Z[k][l] = V[((e[l] * 32 + k) * SCRYPT_TMTO_WAYS) + l];
+		memcpy(&mv, m, sizeof(mv));
+		for (k = 0; k < steps; k++) {
+			memcpy(T, Z, sizeof(T));
+			xor_salsa8_tmto(&T[0], &T[16]);
+			xor_salsa8_tmto(&T[16], &T[0]);
+			mask = (scrypt_tmto_vec)(mv > (uint32_t)k);
+			for (l = 0; l < 32; l++)
+				Z[l] = (T[l] & mask) | (Z[l] & ~mask);
+		}
+		for (k = 0; k < 32; k++)
+			Xv[k] ^= Z[k];
+		xor_salsa8_tmto(&Xv[0], &Xv[16]);
+		xor_salsa8_tmto(&Xv[16], &Xv[0]);
+	}
+}
+
+#endif /* __GNUC__ */
+
+#ifdef __linux__
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED	1
+#endif
+#define HUGE_PAGE_SIZE	(2UL << 20)
+
+/* Return the NUMA node shared by all the CPUs the calling thread may run
+ * on, or -1 if they span several nodes or the topology is unknown. */
+static int scrypt_local_node(void)
+{
+	cpu_set_t set;
+	int cpu, node = -1;
+
+	if (sched_getaffinity(0, sizeof(set), &set))
+		return -1;
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		int n;
+
+		if (!CPU_ISSET(cpu, &set))
+			continue;
+		n = cpu_node(cpu);
+		if (n < 0 || (node >= 0 && n != node))
+			return -1;
+		node = n;
+	}
+	return node;
+}
+
+/* The scratchpad is read at random offsets, so back it with huge pages
+ * where possible, keep it on the local node and fault it in up front. */
+/* Page kind of the first scratchpad, reported for all of them. */
+static const char *first_kind;
+
+static unsigned char *scrypt_buffer_map(size_t size)
+{
+	const char *kind = "explicit huge", *first;
+	unsigned char *buf = MAP_FAILED;
+	unsigned long nodemask;
+	int node;
+
+	size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+	buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (buf == MAP_FAILED && opt_debug)
+		applog(LOG_DEBUG, "DEBUG: MAP_HUGETLB failed (errno = %d), "
+		       "trying transparent huge pages", errno);
+#endif
+	if (buf == MAP_FAILED) {
+		buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buf == MAP_FAILED) {
+			applog(LOG_WARNING, "scrypt scratchpad mmap failed "
+			       "(errno = %d), falling back to malloc", errno);
+			return NULL;
+		}
+		kind = "transparent huge";
+#ifdef MADV_HUGEPAGE
+		if (madvise(buf, size, MADV_HUGEPAGE)) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "DEBUG: MADV_HUGEPAGE failed "
+				       "(errno = %d), using normal pages", errno);
+			kind = "normal";
+		}
+#else
+		kind = "normal";
+#endif
+	}
+
+	node = scrypt_local_node();
+#ifdef SYS_mbind
+	if (node >= 0 && node < 8 * sizeof(nodemask)) {
+		nodemask = 1UL << node;
+		if (syscall(SYS_mbind, buf, size, MPOL_PREFERRED,
+		            &nodemask, 8 * sizeof(nodemask), 0)) {
+			if (opt_debug)
+				applog(LOG_DEBUG, "DEBUG: mbind to node %d failed "
+				       "(errno = %d)", node, errno);
+			node = -1;
+		}
+	}
+#else
+	node = -1;
+#endif
+
+	memset(buf, 0, size);
+
+	/* say once what the scratchpads got, and again only if it differs */
+	first = NULL;
+	if (__atomic_compare_exchange_n(&first_kind, &first, kind, false,
+	                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		applog(LOG_INFO, "scrypt scratchpads: %lu kB each in %s pages",
+		       (unsigned long)(size >> 10), kind);
+	else if (strcmp(first, kind))
+		applog(LOG_INFO, "scrypt scratchpad: %lu kB in %s pages",
+		       (unsigned long)(size >> 10), kind);
+	if (opt_debug && node >= 0)
+		applog(LOG_DEBUG, "DEBUG: scrypt scratchpad: %lu kB in %s pages "
+		       "on node %d", (unsigned long)(size >> 10), kind, node);
+	else if (opt_debug)
+		applog(LOG_DEBUG, "DEBUG: scrypt scratchpad: %lu kB in %s pages",
+		       (unsigned long)(size >> 10), kind);
+	return buf;
+}
+
+#endif /* __linux__ */
+
+unsigned char *scrypt_buffer_alloc(int N)
+{
+	size_t size = (size_t)N * SCRYPT_MAX_WAYS * 128 + 63;
+#ifdef HAVE_SCRYPT_TMTO
+	if (opt_scrypt_tmto > 1)
+		size = (size_t)((N + opt_scrypt_tmto - 1) / opt_scrypt_tmto)
+		       * SCRYPT_TMTO_WAYS * 128 + 63;
+#endif
+#ifdef __linux__
+	unsigned char *buf = scrypt_buffer_map(size);
+	if (buf)
+		return buf;
+#endif
+	return malloc(size);
+}
+
+static void scrypt_1024_1_1_256(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[8], ostate[8];
+	uint32_t X[32] __attribute__((aligned(128)));
+	uint32_t *V;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	memcpy(tstate, midstate, 32);
+	HMAC_SHA256_80_init(input, tstate, ostate);
+	PBKDF2_SHA256_80_128(tstate, ostate, input, X);
+
+	scrypt_core(X, V, N);
+
+	PBKDF2_SHA256_128_32(tstate, ostate, X, output);
+}
+
+#ifdef HAVE_SCRYPT_3WAY
+
+static void scrypt_1024_1_1_256_3way(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[3 * 8], ostate[3 * 8];
+	uint32_t X[3 * 32] __attribute__((aligned(64)));
+	uint32_t *V;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	memcpy(tstate +  0, midstate, 32);
+	memcpy(tstate +  8, midstate, 32);
+	memcpy(tstate + 16, midstate, 32);
+	HMAC_SHA256_80_init(input +  0, tstate +  0, ostate +  0);
+	HMAC_SHA256_80_init(input + 20, tstate +  8, ostate +  8);
+	HMAC_SHA256_80_init(input + 40, tstate + 16, ostate + 16);
+	PBKDF2_SHA256_80_128(tstate +  0, ostate +  0, input +  0, X +  0);
+	PBKDF2_SHA256_80_128(tstate +  8, ostate +  8, input + 20, X + 32);
+	PBKDF2_SHA256_80_128(tstate + 16, ostate + 16, input + 40, X + 64);
+
+	scrypt_core_3way(X, V, N);
+
+	PBKDF2_SHA256_128_32(tstate +  0, ostate +  0, X +  0, output +  0);
+	PBKDF2_SHA256_128_32(tstate +  8, ostate +  8, X + 32, output +  8);
+	PBKDF2_SHA256_128_32(tstate + 16, ostate + 16, X + 64, output + 16);
+}
+
+#endif /* HAVE_SCRYPT_3WAY */
+
+#ifdef HAVE_SCRYPT_6WAY
+
+static void scrypt_1024_1_1_256_6way(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[6 * 8], ostate[6 * 8];
+	uint32_t X[6 * 32] __attribute__((aligned(128)));
+	uint32_t *V;
+	int i;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (i = 0; i < 6; i++) {
+		memcpy(tstate + 8 * i, midstate, 32);
+		HMAC_SHA256_80_init(input + 20 * i, tstate + 8 * i, ostate + 8 * i);
+		PBKDF2_SHA256_80_128(tstate + 8 * i, ostate + 8 * i,
+		                     input + 20 * i, X + 32 * i);
+	}
+
+	scrypt_core_6way(X, V, N);
+
+	for (i = 0; i < 6; i++)
+		PBKDF2_SHA256_128_32(tstate + 8 * i, ostate + 8 * i,
+		                     X + 32 * i, output + 8 * i);
+}
+
+#endif /* HAVE_SCRYPT_6WAY */
+
+#ifdef HAVE_SCRYPT_16WAY
+
+static void scrypt_1024_1_1_256_16way(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[16 * 8] __attribute__((aligned(128)));
+	uint32_t ostate[16 * 8] __attribute__((aligned(128)));
+	uint32_t W[16 * 32] __attribute__((aligned(128)));
+	uint32_t X[16 * 32] __attribute__((aligned(128)));
+	uint32_t *V;
+	int i, j, k;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 20; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = input[8 * 20 * j + k * 20 + i];
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				tstate[8 * 8 * j + 8 * i + k] = midstate[i];
+	HMAC_SHA256_80_init_8way(W +   0, tstate +  0, ostate +  0);
+	HMAC_SHA256_80_init_8way(W + 256, tstate + 64, ostate + 64);
+	PBKDF2_SHA256_80_128_8way(tstate +  0, ostate +  0, W +   0, W +   0);
+	PBKDF2_SHA256_80_128_8way(tstate + 64, ostate + 64, W + 256, W + 256);
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				X[8 * 32 * j + k * 32 + i] = W[8 * 32 * j + 8 * i + k];
+	
+	scrypt_core_16way(X, V, N);
+	
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = X[8 * 32 * j + k * 32 + i];
+	PBKDF2_SHA256_128_32_8way(tstate +  0, ostate +  0, W +   0, W +   0);
+	PBKDF2_SHA256_128_32_8way(tstate + 64, ostate + 64, W + 256, W + 256);
+	for (j = 0; j < 2; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				output[8 * 8 * j + k * 8 + i] = W[8 * 32 * j + 8 * i + k];
+}
+
+#endif /* HAVE_SCRYPT_16WAY */
+
+#ifdef HAVE_SCRYPT_12WAY
+
+static void scrypt_1024_1_1_256_12way(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[12 * 8] __attribute__((aligned(128)));
+	uint32_t ostate[12 * 8] __attribute__((aligned(128)));
+	uint32_t W[12 * 32] __attribute__((aligned(128)));
+	uint32_t X[12 * 32] __attribute__((aligned(128)));
+	uint32_t *V;
+	int i, j, k;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 20; i++)
+			for (k = 0; k < 4; k++)
+				W[4 * 32 * j + 4 * i + k] = input[4 * 20 * j + k * 20 + i];
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 4; k++)
+				tstate[4 * 8 * j + 4 * i + k] = midstate[i];
+	for (j = 0; j < 3; j++) {
+		HMAC_SHA256_80_init_4way(W + 128 * j, tstate + 32 * j,
+		                         ostate + 32 * j);
+		PBKDF2_SHA256_80_128_4way(tstate + 32 * j, ostate + 32 * j,
+		                          W + 128 * j, W + 128 * j);
+	}
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 4; k++)
+				X[4 * 32 * j + k * 32 + i] = W[4 * 32 * j + 4 * i + k];
+	
+	for (j = 0; j < 4; j++)
+		scrypt_core_3way(X + 3 * 32 * j, V, N);
+	
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 4; k++)
+				W[4 * 32 * j + 4 * i + k] = X[4 * 32 * j + k * 32 + i];
+	for (j = 0; j < 3; j++)
+		PBKDF2_SHA256_128_32_4way(tstate + 32 * j, ostate + 32 * j,
+		                          W + 128 * j, W + 128 * j);
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 4; k++)
+				output[4 * 8 * j + k * 8 + i] = W[4 * 32 * j + 4 * i + k];
+}
+
+#endif /* HAVE_SCRYPT_12WAY */
+
+#ifdef HAVE_SCRYPT_24WAY
+
+static void scrypt_1024_1_1_256_24way(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N)
+{
+	uint32_t tstate[24 * 8] __attribute__((aligned(128)));
+	uint32_t ostate[24 * 8] __attribute__((aligned(128)));
+	uint32_t W[24 * 32] __attribute__((aligned(128)));
+	uint32_t X[24 * 32] __attribute__((aligned(128)));
+	uint32_t *V;
+	int i, j, k;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+	
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 20; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = input[8 * 20 * j + k * 20 + i];
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				tstate[8 * 8 * j + 8 * i + k] = midstate[i];
+	for (j = 0; j < 3; j++) {
+		HMAC_SHA256_80_init_8way(W + 256 * j, tstate + 64 * j,
+		                         ostate + 64 * j);
+		PBKDF2_SHA256_80_128_8way(tstate + 64 * j, ostate + 64 * j,
+		                          W + 256 * j, W + 256 * j);
+	}
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				X[8 * 32 * j + k * 32 + i] = W[8 * 32 * j + 8 * i + k];
+	
+	for (j = 0; j < 4; j++)
+		scrypt_core_6way(X + 6 * 32 * j, V, N);
+	
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 32; i++)
+			for (k = 0; k < 8; k++)
+				W[8 * 32 * j + 8 * i + k] = X[8 * 32 * j + k * 32 + i];
+	for (j = 0; j < 3; j++)
+		PBKDF2_SHA256_128_32_8way(tstate + 64 * j, ostate + 64 * j,
+		                          W + 256 * j, W + 256 * j);
+	for (j = 0; j < 3; j++)
+		for (i = 0; i < 8; i++)
+			for (k = 0; k < 8; k++)
+				output[8 * 8 * j + k * 8 + i] = W[8 * 32 * j + 8 * i + k];
+}
+
+#endif /* HAVE_SCRYPT_24WAY */
+
+#ifdef HAVE_SCRYPT_TMTO
+
+static void scrypt_1024_1_1_256_tmto(const uint32_t *input,
+	uint32_t *output, uint32_t *midstate, unsigned char *scratchpad, int N,
+	int gap)
+{
+	uint32_t tstate[SCRYPT_TMTO_WAYS * 8], ostate[SCRYPT_TMTO_WAYS * 8];
+	uint32_t W[SCRYPT_TMTO_WAYS * 32];
+	uint32_t X[SCRYPT_TMTO_WAYS * 32] __attribute__((aligned(64)));
+	uint32_t *V;
+	int i, k;
+	
+	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
+
+	for (i = 0; i < SCRYPT_TMTO_WAYS; i++) {
+		memcpy(tstate + 8 * i, midstate, 32);
+		HMAC_SHA256_80_init(input + 20 * i, tstate + 8 * i, ostate + 8 * i);
+		PBKDF2_SHA256_80_128(tstate + 8 * i, ostate + 8 * i,
+		                     input + 20 * i, W + 32 * i);
+	}
+	for (i = 0; i < SCRYPT_TMTO_WAYS; i++)
+		for (k = 0; k < 32; k++)
+			X[k * SCRYPT_TMTO_WAYS + i] = W[32 * i + k];
+
+	scrypt_core_tmto(X, V, N, gap);
+
+	for (i = 0; i < SCRYPT_TMTO_WAYS; i++)
+		for (k = 0; k < 32; k++)
+			W[32 * i + k] = X[k * SCRYPT_TMTO_WAYS + i];
+	for (i = 0; i < SCRYPT_TMTO_WAYS; i++)
+		PBKDF2_SHA256_128_32(tstate + 8 * i, ostate + 8 * i,
+		                     W + 32 * i, output + 8 * i);
+}
+
+#endif /* HAVE_SCRYPT_TMTO */
+
+typedef void (*scrypt_hash_fn)(const uint32_t *input, uint32_t *output,
+	uint32_t *midstate, unsigned char *scratchpad, int N);
+
+/*
+ * ways is the number of hashes per call, lanes the width of the ROMix
+ * core it runs, and sha the width of the SHA-256 kernel used for PBKDF2.
+ * For each core width, batched variants come first.
+ */
+static const struct {
+	int ways;
+	int lanes;
+	int sha;
+	scrypt_hash_fn hash;
+} scrypt_kernels[] = {
+#ifdef HAVE_SCRYPT_16WAY
+	{ 16, 16, 8, scrypt_1024_1_1_256_16way },
+#endif
+#ifdef HAVE_SCRYPT_24WAY
+	{ 24, 6, 8, scrypt_1024_1_1_256_24way },
+#endif
+#ifdef HAVE_SCRYPT_6WAY
+	{ 6, 6, 1, scrypt_1024_1_1_256_6way },
+#endif
+#ifdef HAVE_SCRYPT_12WAY
+	{ 12, 3, 4, scrypt_1024_1_1_256_12way },
+#endif
+#ifdef HAVE_SCRYPT_3WAY
+	{ 3, 3, 1, scrypt_1024_1_1_256_3way },
+#endif
+	{ 1, 1, 1, scrypt_1024_1_1_256 },
+};
+
+#define SCRYPT_KERNELS (int)(sizeof(scrypt_kernels) / sizeof(scrypt_kernels[0]))
+
+/* Hashes per call used by scanhash_scrypt, or 0 if not chosen yet. */
+static int scrypt_throughput;
+
+static bool scrypt_kernel_usable(int k)
+{
+	if (scrypt_kernels[k].lanes > scrypt_best_throughput())
+		return false;
+#ifdef HAVE_SHA256_4WAY
+	if (scrypt_kernels[k].sha == 4 && !sha256_use_4way())
+		return false;
+#endif
+#ifdef HAVE_SHA256_8WAY
+	if (scrypt_kernels[k].sha == 8 && !sha256_use_8way())
+		return false;
+#endif
+	return true;
+}
+
+/* The widest core the CPU supports, batched if possible. */
+static int scrypt_default_throughput(void)
+{
+	int k;
+
+	for (k = 0; k < SCRYPT_KERNELS; k++)
+		if (scrypt_kernels[k].lanes == scrypt_best_throughput() &&
+		    scrypt_kernel_usable(k))
+			return scrypt_kernels[k].ways;
+	return 1;
+}
+
+struct scrypt_tune_ctx {
+	scrypt_hash_fn hash;
+	int ways;
+	int lanes;
+	int N;
+	volatile bool *stop;
+	volatile unsigned long hashes;
+};
+
+static void *scrypt_tune_thread(void *userdata)
+{
+	struct scrypt_tune_ctx *ctx = userdata;
+	uint32_t data[SCRYPT_MAX_BATCH * 20], hash[SCRYPT_MAX_BATCH * 8];
+	uint32_t midstate[8];
+	unsigned char *scratchbuf;
+
+	scratchbuf = malloc((size_t)ctx->N * ctx->lanes * 128 + 63);
+	if (!scratchbuf)
+		return NULL;
+	memset(data, 0, sizeof(data));
+	sha256_init(midstate);
+	sha256_transform(midstate, data, 0);
+	do {
+		ctx->hash(data, hash, midstate, scratchbuf, ctx->N);
+		ctx->hashes += ctx->ways;
+	} while (!*ctx->stop);
+	free(scratchbuf);
+	return NULL;
+}
+
+/* Time one kernel on the given number of threads; returns hashes/s. */
+static double scrypt_tune_kernel(int k, int N, int threads)
+{
+	struct scrypt_tune_ctx *ctx;
+	pthread_t *pth;
+	struct timeval tv_start, tv_end, diff;
+	volatile bool stop = false;
+	unsigned long hashes;
+	bool done;
+	int i, started;
+
+	ctx = calloc(threads, sizeof(*ctx));
+	pth = calloc(threads, sizeof(*pth));
+	if (!ctx || !pth) {
+		free(ctx);
+		free(pth);
+		return 0;
+	}
+	gettimeofday(&tv_start, NULL);
+	for (started = 0; started < threads; started++) {
+		ctx[started].hash = scrypt_kernels[k].hash;
+		ctx[started].ways = scrypt_kernels[k].ways;
+		ctx[started].lanes = scrypt_kernels[k].lanes;
+		ctx[started].N = N;
+		ctx[started].stop = &stop;
+		if (pthread_create(&pth[started], NULL, scrypt_tune_thread,
+		                   &ctx[started]))
+			break;
+	}
+	/* run for at least a second, and until every thread has finished
+	 * at least one call */
+	do {
+		sleep(1);
+		done = true;
+		for (i = 0; i < started; i++)
+			if (!ctx[i].hashes)
+				done = false;
+	} while (!done);
+	gettimeofday(&tv_end, NULL);
+	for (hashes = 0, i = 0; i < started; i++)
+		hashes += ctx[i].hashes;
+	stop = true;
+	for (i = 0; i < started; i++)
+		pthread_join(pth[i], NULL);
+	free(ctx);
+	free(pth);
+
+	timeval_subtract(&diff, &tv_end, &tv_start);
+	return hashes / (diff.tv_sec + 1e-6 * diff.tv_usec);
+}
+
+static void scrypt_cpu_model(char *model, size_t len)
+{
+	char *p;
+	
+	model[0] = '\0';
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+	if (len > 48 && __get_cpuid_max(0x80000000, NULL) >= 0x80000004) {
+		uint32_t *brand = (uint32_t *)model;
+		int i;
+		for (i = 0; i < 3; i++)
+			__get_cpuid(0x80000002 + i, &brand[4 * i], &brand[4 * i + 1],
+			            &brand[4 * i + 2], &brand[4 * i + 3]);
+		model[48] = '\0';
+	}
+#elif defined(__linux__)
+	FILE *f = fopen("/proc/cpuinfo", "r");
+	char line[256];
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (strncmp(line, "model name", 10) &&
+			    strncmp(line, "Hardware", 8))
+				continue;
+			p = strchr(line, ':');
+			if (p) {
+				snprintf(model, len, "%s", p + 1);
+				break;
+			}
+		}
+		fclose(f);
+	}
+#endif
+	/* trim whitespace; the model is stored as the rest of a line */
+	for (p = model; *p == ' ' || *p == '\t'; p++) ;
+	memmove(model, p, strlen(p) + 1);
+	for (p = model + strlen(model); p > model && (unsigned char)p[-1] <= ' '; )
+		*--p = '\0';
+}
+
+static FILE *scrypt_tune_file(const char *mode)
+{
+	const char *home = getenv("HOME");
+	char path[1024];
+
+	if (!home || !*home)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/.cpuminer-scrypt-tune", home);
+	return fopen(path, mode);
+}
+
+/*
+ * Pick the fastest scrypt kernel for this N and thread count by timing
+ * each of them on all threads at once.  Results are remembered per CPU
+ * model in ~/.cpuminer-scrypt-tune, so calibration only runs once.
+ */
+void scrypt_autotune(int N, int threads)
+{
+	char model[128], line[256];
+	double rate, best_rate = 0;
+	int k, usable, best = -1;
+	FILE *f;
+
+	for (usable = 0, k = 0; k < SCRYPT_KERNELS; k++)
+		if (scrypt_kernel_usable(k))
+			usable++;
+	if (usable < 2)
+		return;
+
+	scrypt_cpu_model(model, sizeof(model));
+	if (model[0] && (f = scrypt_tune_file("r"))) {
+		while (fgets(line, sizeof(line), f)) {
+			int n, t, ways, pos = 0;
+			if (sscanf(line, "%d %d %d %n", &n, &t, &ways, &pos) < 3 ||
+			    n != N || t != threads)
+				continue;
+			line[strcspn(line, "\r\n")] = '\0';
+			if (strcmp(line + pos, model))
+				continue;
+			for (k = 0; k < SCRYPT_KERNELS; k++)
+				if (scrypt_kernels[k].ways == ways &&
+				    scrypt_kernel_usable(k))
+					best = k;
+		}
+		fclose(f);
+		if (best >= 0) {
+			scrypt_throughput = scrypt_kernels[best].ways;
+			applog(LOG_INFO, "scrypt autotune: using %d-way kernel (cached)",
+			       scrypt_throughput);
+			return;
+		}
+	}
+
+	applog(LOG_INFO, "scrypt autotune: calibrating on %d thread%s...",
+	       threads, threads == 1 ? "" : "s");
+	for (k = 0; k < SCRYPT_KERNELS; k++) {
+		if (!scrypt_kernel_usable(k))
+			continue;
+		rate = scrypt_tune_kernel(k, N, threads);
+		applog(LOG_INFO, "scrypt autotune: %d-way kernel: %.2f khash/s",
+		       scrypt_kernels[k].ways, rate / 1000);
+		if (rate > best_rate) {
+			best_rate = rate;
+			best = k;
+		}
+	}
+	if (best < 0)
+		return;
+	scrypt_throughput = scrypt_kernels[best].ways;
+	applog(LOG_INFO, "scrypt autotune: using %d-way kernel", scrypt_throughput);
+
+	if (model[0] && (f = scrypt_tune_file("a"))) {
+		fprintf(f, "%d %d %d %s\n", N, threads, scrypt_throughput, model);
+		fclose(f);
+	}
+}
+
+/*
+ * Pick a TMTO gap for scrypt(N) so that the scratchpads of all the miner
+ * threads fit in the share of L2 + L3 available to each of them.
+ * Returns 0 when the full scratchpad fits or the cache size is unknown.
+ */
+int scrypt_tmto_auto(int N, int threads)
+{
+#if defined(HAVE_SCRYPT_TMTO) && defined(_SC_LEVEL2_CACHE_SIZE) && \
+    defined(_SC_LEVEL3_CACHE_SIZE)
+	long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+	long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+	size_t budget;
+	int gap, max_gap;
+
+	if (l2 <= 0 && l3 <= 0) {
+		applog(LOG_INFO, "scrypt TMTO: cache size unknown, disabled");
+		return 0;
+	}
+	if (threads < 1)
+		threads = 1;
+	budget = (l2 > 0 ? l2 : 0) + (l3 > 0 ? l3 : 0) / threads;
+	if ((size_t)N * 128 * scrypt_best_throughput() <= budget) {
+		applog(LOG_INFO, "scrypt TMTO: %d kB scratchpad fits in cache, disabled",
+			N * 128 * scrypt_best_throughput() / 1024);
+		return 0;
+	}
+	max_gap = N < 64 ? N : 64;
+	for (gap = 2; gap < max_gap; gap *= 2)
+		if ((size_t)((N + gap - 1) / gap) * 128 * SCRYPT_TMTO_WAYS <= budget)
+			break;
+	applog(LOG_INFO, "scrypt TMTO: storing 1/%d of V (%lu kB per thread, %lu kB cache budget)",
+		gap, (unsigned long)((N + gap - 1) / gap) * 128 * SCRYPT_TMTO_WAYS / 1024,
+		(unsigned long)budget / 1024);
+	return gap;
+#else
+	return 0;
+#endif
+}
+
+int scanhash_scrypt(int thr_id, uint32_t *pdata,
+	unsigned char *scratchbuf, const uint32_t *ptarget,
+	uint32_t max_nonce, unsigned long *hashes_done, int N)
+{
+	uint32_t data[SCRYPT_MAX_BATCH * 20], hash[SCRYPT_MAX_BATCH * 8];
+	uint32_t midstate[8];
+	uint32_t n = pdata[19] - 1;
+	const uint32_t Htarg = ptarget[7];
+	int throughput;
+	int i;
+	
+	if (!scrypt_throughput)
+		scrypt_throughput = scrypt_default_throughput();
+	throughput = scrypt_throughput;
+	
+#ifdef HAVE_SCRYPT_TMTO
+	if (opt_scrypt_tmto > 1)
+		throughput = SCRYPT_TMTO_WAYS;
+#endif
+	
+	for (i = 0; i < throughput; i++)
+		memcpy(data + i * 20, pdata, 80);
+	
+	sha256_init(midstate);
+	sha256_transform(midstate, data, 0);
+	
+	do {
+		for (i = 0; i < throughput; i++)
+			data[i * 20 + 19] = ++n;
+		
+#if defined(HAVE_SCRYPT_TMTO)
+		if (opt_scrypt_tmto > 1)
+			scrypt_1024_1_1_256_tmto(data, hash, midstate, scratchbuf, N,
+			                         opt_scrypt_tmto);
+		else
+#endif
+#if defined(HAVE_SCRYPT_24WAY)
+		if (throughput == 24)
+			scrypt_1024_1_1_256_24way(data, hash, midstate, scratchbuf, N);
+		else
+#endif
+#if defined(HAVE_SCRYPT_16WAY)
+		if (throughput == 16)
+			scrypt_1024_1_1_256_16way(data, hash, midstate, scratchbuf, N);
+		else
+#endif
+#if defined(HAVE_SCRYPT_12WAY)
+		if (throughput == 12)
+			scrypt_1024_1_1_256_12way(data, hash, midstate, scratchbuf, N);
+		else
+#endif
+#if defined(HAVE_SCRYPT_6WAY)
+		if (throughput == 6)
+			scrypt_1024_1_1_256_6way(data, hash, midstate, scratchbuf, N);
+		else
+#endif
+#if defined(HAVE_SCRYPT_3WAY)
+		if (throughput == 3)
+			scrypt_1024_1_1_256_3way(data, hash, midstate, scratchbuf, N);
+		else
+#endif
+		scrypt_1024_1_1_256(data, hash, midstate, scratchbuf, N);
+		
+		for (i = 0; i < throughput; i++) {
+			if (hash[i * 8 + 7] <= Htarg && fulltest(hash + i * 8, ptarget)) {
+				*hashes_done = n - pdata[19] + 1;
+				pdata[19] = data[i * 20 + 19];
+				return 1;
+			}
+		}
+	} while (n < max_nonce && !work_restart[thr_id].restart);
+	
+	*hashes_done = n - pdata[19] + 1;
+	pdata[19] = n;
+	return 0;
+}
@@ -196,12 +196,17 @@ static void sha256d_80_swap(uint32_t *hash, const uint32_t *data)
 		hash[i] = swab32(hash[i]);
 }
 
-void sha256d(unsigned char *hash, const unsigned char *data, int len)
+/*
+ * Complete a SHA-256d whose first total - len bytes have already been
+ * compressed into midstate; data holds the remaining len bytes.
+ */
+void sha256d_resume(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total)
 {
 	uint32_t S[16], T[16];
 	int i, r;
 
-	sha256_init(S);
+	memcpy(S, midstate, 32);
 	for (r = len; r > -9; r -= 64) {
 		if (r < 64)
 			memset(T, 0, 64);
@@ -211,7 +216,7 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 		for (i = 0; i < 16; i++)
 			T[i] = be32dec(T + i);
 		if (r < 56)
-			T[15] = 8 * len;
+			T[15] = 8 * total;
 		sha256_transform(S, T, 0);
 	}
 	memcpy(S + 8, sha256d_hash1 + 8, 32);
@@ -221,6 +226,82 @@ void sha256d(unsigned char *hash, const unsigned char *data, int len)
 		be32enc((uint32_t *)hash + i, T[i]);
 }
 
+void sha256d(unsigned char *hash, const unsigned char *data, int len)
+{
+	uint32_t S[8];
+
+	sha256_init(S);
+	sha256d_resume(hash, S, data, len, len);
+}
+
+#if defined(HAVE_SHA256_4WAY) || defined(HAVE_SHA256_8WAY)
+
+static void sha256d_resume_nway(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total, int ways,
+	void (*init)(uint32_t *),
+	void (*transform)(uint32_t *, const uint32_t *, int))
+{
+	uint32_t S[8 * 8] __attribute__((aligned(32)));
+	uint32_t T[8 * 16] __attribute__((aligned(32)));
+	uint32_t W[16];
+	int i, j, r;
+
+	for (i = 0; i < 8; i++)
+		for (j = 0; j < ways; j++)
+			S[ways * i + j] = midstate[i];
+	for (r = len; r > -9; r -= 64) {
+		for (j = 0; j < ways; j++) {
+			if (r < 64)
+				memset(W, 0, 64);
+			memcpy(W, data + j * len + len - r,
+			       r > 64 ? 64 : (r < 0 ? 0 : r));
+			if (r >= 0 && r < 64)
+				((unsigned char *)W)[r] = 0x80;
+			for (i = 0; i < 16; i++)
+				T[ways * i + j] = be32dec(W + i);
+			if (r < 56)
+				T[ways * 15 + j] = 8 * total;
+		}
+		transform(S, T, 0);
+	}
+	memcpy(T, S, ways * 32);
+	for (i = 8; i < 16; i++)
+		for (j = 0; j < ways; j++)
+			T[ways * i + j] = sha256d_hash1[i];
+	init(S);
+	transform(S, T, 0);
+	for (j = 0; j < ways; j++)
+		for (i = 0; i < 8; i++)
+			be32enc((uint32_t *)(hash + 32 * j) + i, S[ways * i + j]);
+}
+
+#endif
+
+/*
+ * Same as sha256d_resume on n messages of len bytes stored back to back,
+ * using the multi-buffer kernels where the CPU has them.
+ */
+void sha256d_resume_multi(unsigned char *hash, const uint32_t *midstate,
+	const unsigned char *data, int len, int total, int n)
+{
+#ifdef HAVE_SHA256_8WAY
+	if (n >= 8 && sha256_use_8way()) {
+		for (; n >= 8; n -= 8, data += 8 * len, hash += 8 * 32)
+			sha256d_resume_nway(hash, midstate, data, len, total, 8,
+			                    sha256_init_8way, sha256_transform_8way);
+	}
+#endif
+#ifdef HAVE_SHA256_4WAY
+	if (n >= 4 && sha256_use_4way()) {
+		for (; n >= 4; n -= 4, data += 4 * len, hash += 4 * 32)
+			sha256d_resume_nway(hash, midstate, data, len, total, 4,
+			                    sha256_init_4way, sha256_transform_4way);
+	}
+#endif
+	for (; n > 0; n--, data += len, hash += 32)
+		sha256d_resume(hash, midstate, data, len, total);
+}
+
 static inline void sha256d_preextend(uint32_t *W)
 {
 	W[16] = s1(W[14]) + W[ 9] + s0(W[ 1]) + W[ 0];
@@ -32,10 +32,18 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/epoll.h>
+#include <linux/futex.h>
 #endif
 #include "compat.h"
 #include "miner.h"
-#include "elist.h"
 
 struct data_buffer {
 	void		*buf;
@@ -43,9 +51,10 @@ struct data_buffer {
 };
 
 struct upload_buffer {
-	const void	*buf;
-	size_t		len;
-	size_t		pos;
+	const struct rpc_iov	*iov;
+	int			iovcnt;
+	size_t			len;
+	size_t			pos;
 };
 
 struct header_info {
@@ -54,18 +63,33 @@ struct header_info {
 	char		*stratum_url;
 };
 
-struct tq_ent {
+/*
+ * Thread queues are bounded multi-producer rings of preallocated cells.
+ * Each cell carries a sequence number telling whether it is ready to
+ * be filled or to be consumed at a given position.  A consumer only
+ * sleeps when the ring is empty, waiting for the event counter to move.
+ */
+#define TQ_SIZE		256
+
+struct tq_cell {
+	unsigned long		seq;
 	void			*data;
-	struct list_head	q_node;
 };
 
 struct thread_q {
-	struct list_head	q;
-
-	bool frozen;
-
+	unsigned long		head;		/* next position to pop */
+	char			pad1[64 - sizeof(unsigned long)];
+	unsigned long		tail;		/* next position to push */
+	char			pad2[64 - sizeof(unsigned long)];
+	int			event;		/* bumped by push, freeze and thaw */
+	int			waiters;
+	int			interrupts;	/* bumped by freeze and thaw */
+	bool			frozen;
+#ifndef __linux__
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
+#endif
+	struct tq_cell		cell[TQ_SIZE];
 };
 
 void applog(int prio, const char *fmt, ...)
@@ -210,17 +234,26 @@ static size_t upload_data_cb(void *ptr, size_t size, size_t nmemb,
 			     void *user_data)
 {
 	struct upload_buffer *ub = user_data;
-	int len = size * nmemb;
+	size_t len = size * nmemb, done = 0, off = ub->pos;
+	int i;
 
-	if (len > ub->len - ub->pos)
-		len = ub->len - ub->pos;
+	for (i = 0; i < ub->iovcnt && done < len; i++) {
+		size_t n;
 
-	if (len) {
-		memcpy(ptr, ub->buf + ub->pos, len);
-		ub->pos += len;
+		if (off >= ub->iov[i].len) {
+			off -= ub->iov[i].len;
+			continue;
+		}
+		n = ub->iov[i].len - off;
+		if (n > len - done)
+			n = len - done;
+		memcpy((char *)ptr + done, (const char *)ub->iov[i].buf + off, n);
+		done += n;
+		off = 0;
 	}
+	ub->pos += done;
 
-	return len;
+	return done;
 }
 
 #if LIBCURL_VERSION_NUM >= 0x071200
@@ -347,28 +380,33 @@ static int sockopt_keepalive_cb(void *userdata, curl_socket_t fd,
 }
 #endif
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      int *curl_err, int flags)
+/*
+ * Requests are split in two halves so that they can be driven either
+ * by curl_easy_perform() or by a multi handle.  The easy handles come
+ * from json_rpc_handle() and are never reset between requests, so that
+ * libcurl keeps their connection alive; only the options that change
+ * from one request to the next are set by json_rpc_begin().
+ */
+struct rpc_req {
+	CURL			*curl;
+	int			flags;
+	struct data_buffer	all_data;
+	struct upload_buffer	upload_data;
+	struct header_info	hi;
+	struct curl_slist	*headers;
+	char			curl_err_str[CURL_ERROR_SIZE];
+};
+
+CURL *json_rpc_handle(void)
 {
-	json_t *val, *err_val, *res_val;
-	int rc;
-	long http_rc;
-	struct data_buffer all_data = {0};
-	struct upload_buffer upload_data;
-	char *json_buf;
-	json_error_t err;
-	struct curl_slist *headers = NULL;
-	char len_hdr[64];
-	char curl_err_str[CURL_ERROR_SIZE];
-	long timeout = (flags & JSON_RPC_LONGPOLL) ? opt_timeout : 30;
-	struct header_info hi = {0};
+	CURL *curl;
 
-	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
+	curl = curl_easy_init();
+	if (unlikely(!curl))
+		return NULL;
 
 	if (opt_protocol)
 		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1);
-	curl_easy_setopt(curl, CURLOPT_URL, url);
 	if (opt_cert)
 		curl_easy_setopt(curl, CURLOPT_CAINFO, opt_cert);
 	curl_easy_setopt(curl, CURLOPT_ENCODING, "");
@@ -376,92 +414,166 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
 	curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
 #if LIBCURL_VERSION_NUM >= 0x071200
 	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, &seek_data_cb);
-	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &upload_data);
 #endif
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
 	if (opt_redirect)
 		curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
-	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
 	if (opt_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, opt_proxy);
 		curl_easy_setopt(curl, CURLOPT_PROXYTYPE, opt_proxy_type);
 	}
-	if (userpass) {
-		curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
-		curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+	curl_easy_setopt(curl, CURLOPT_HTTPAUTH, CURLAUTH_BASIC);
+	curl_easy_setopt(curl, CURLOPT_POST, 1);
+
+	return curl;
+}
+
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      int *curl_err, int flags)
+{
+	struct rpc_iov iov;
+
+	iov.buf = rpc_req;
+	iov.len = strlen(rpc_req);
+	return json_rpc_call_iov(curl, url, userpass, &iov, 1, curl_err, flags);
+}
+
+/* Same as json_rpc_call, with the request made of iovcnt pieces. */
+json_t *json_rpc_call_iov(CURL *curl, const char *url,
+			  const char *userpass, const struct rpc_iov *iov,
+			  int iovcnt, int *curl_err, int flags)
+{
+	struct rpc_req *req;
+
+	req = json_rpc_begin(curl, url, userpass, iov, iovcnt, flags);
+	if (unlikely(!req)) {
+		if (curl_err != NULL)
+			*curl_err = CURLE_OUT_OF_MEMORY;
+		return NULL;
 	}
+	return json_rpc_end(req, curl_easy_perform(curl), curl_err);
+}
+
+/*
+ * Prepare curl for a request; iov must stay valid until json_rpc_end().
+ * Returns NULL if out of memory.
+ */
+struct rpc_req *json_rpc_begin(CURL *curl, const char *url,
+			       const char *userpass, const struct rpc_iov *iov,
+			       int iovcnt, int flags)
+{
+	struct rpc_req *req;
+	char len_hdr[64];
+	long timeout = (flags & JSON_RPC_LONGPOLL) ? opt_timeout : 30;
+	int i;
+
+	req = calloc(1, sizeof(*req));
+	if (unlikely(!req))
+		return NULL;
+	req->curl = curl;
+	req->flags = flags;
+
+	curl_easy_setopt(curl, CURLOPT_URL, url);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req->all_data);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &req->upload_data);
+#if LIBCURL_VERSION_NUM >= 0x071200
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &req->upload_data);
+#endif
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req->hi);
+	curl_easy_setopt(curl, CURLOPT_USERPWD, userpass);
 #if LIBCURL_VERSION_NUM >= 0x070f06
-	if (flags & JSON_RPC_LONGPOLL)
-		curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION, sockopt_keepalive_cb);
+	curl_easy_setopt(curl, CURLOPT_SOCKOPTFUNCTION,
+	                 (flags & JSON_RPC_LONGPOLL) ? sockopt_keepalive_cb : NULL);
 #endif
-	curl_easy_setopt(curl, CURLOPT_POST, 1);
 
-	if (opt_protocol)
-		applog(LOG_DEBUG, "JSON protocol request:\n%s\n", rpc_req);
+	req->upload_data.iov = iov;
+	req->upload_data.iovcnt = iovcnt;
+	for (i = 0; i < iovcnt; i++)
+		req->upload_data.len += iov[i].len;
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
-	upload_data.pos = 0;
+	if (opt_protocol) {
+		char *s = malloc(req->upload_data.len + 1);
+		if (s) {
+			upload_data_cb(s, 1, req->upload_data.len, &req->upload_data);
+			s[req->upload_data.len] = '\0';
+			req->upload_data.pos = 0;
+			applog(LOG_DEBUG, "JSON protocol request:\n%s\n", s);
+			free(s);
+		}
+	}
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) req->upload_data.len);
+	/* without this, recent libcurl sends the body in chunks */
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE,
+	                 (curl_off_t) req->upload_data.len);
 
-	headers = curl_slist_append(headers, "Content-Type: application/json");
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, "User-Agent: " USER_AGENT);
-	headers = curl_slist_append(headers, "X-Mining-Extensions: midstate");
-	headers = curl_slist_append(headers, "Accept:"); /* disable Accept hdr*/
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	req->headers = curl_slist_append(req->headers, "Content-Type: application/json");
+	req->headers = curl_slist_append(req->headers, len_hdr);
+	req->headers = curl_slist_append(req->headers, "User-Agent: " USER_AGENT);
+	req->headers = curl_slist_append(req->headers, "X-Mining-Extensions: midstate");
+	req->headers = curl_slist_append(req->headers, "Accept:"); /* disable Accept hdr*/
+	req->headers = curl_slist_append(req->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, req->headers);
+
+	return req;
+}
+
+/* Finish a request whose transfer ended with rc, and free it. */
+json_t *json_rpc_end(struct rpc_req *req, CURLcode rc, int *curl_err)
+{
+	CURL *curl = req->curl;
+	json_t *val = NULL, *err_val, *res_val;
+	long http_rc;
+	char *json_buf;
+	json_error_t err;
 
-	rc = curl_easy_perform(curl);
 	if (curl_err != NULL)
 		*curl_err = rc;
 	if (rc) {
 		curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_rc);
-		if (!((flags & JSON_RPC_LONGPOLL) && rc == CURLE_OPERATION_TIMEDOUT) &&
-		    !((flags & JSON_RPC_QUIET_404) && http_rc == 404))
-			applog(LOG_ERR, "HTTP request failed: %s", curl_err_str);
-		if (curl_err && (flags & JSON_RPC_QUIET_404) && http_rc == 404)
+		if (!((req->flags & JSON_RPC_LONGPOLL) && rc == CURLE_OPERATION_TIMEDOUT) &&
+		    !((req->flags & JSON_RPC_QUIET_404) && http_rc == 404))
+			applog(LOG_ERR, "HTTP request failed: %s", req->curl_err_str);
+		if (curl_err && (req->flags & JSON_RPC_QUIET_404) && http_rc == 404)
 			*curl_err = CURLE_OK;
-		goto err_out;
+		goto out;
 	}
 
 	/* If X-Stratum was found, activate Stratum */
-	if (want_stratum && hi.stratum_url &&
-	    !strncasecmp(hi.stratum_url, "stratum+tcp://", 14)) {
+	if (want_stratum && req->hi.stratum_url &&
+	    !strncasecmp(req->hi.stratum_url, "stratum+tcp://", 14)) {
 		have_stratum = true;
-		tq_push(thr_info[stratum_thr_id].q, hi.stratum_url);
-		hi.stratum_url = NULL;
+		tq_push(thr_info[stratum_thr_id].q, req->hi.stratum_url);
+		req->hi.stratum_url = NULL;
 	}
 
 	/* If X-Long-Polling was found, activate long polling */
-	if (!have_longpoll && want_longpoll && hi.lp_path && !have_gbt &&
+	if (!have_longpoll && want_longpoll && req->hi.lp_path && !have_gbt &&
 	    allow_getwork && !have_stratum) {
 		have_longpoll = true;
-		tq_push(thr_info[longpoll_thr_id].q, hi.lp_path);
-		hi.lp_path = NULL;
+		tq_push(thr_info[longpoll_thr_id].q, req->hi.lp_path);
+		req->hi.lp_path = NULL;
 	}
 
-	if (!all_data.buf) {
+	if (!req->all_data.buf) {
 		applog(LOG_ERR, "Empty data received in json_rpc_call.");
-		goto err_out;
+		goto out;
 	}
 
-	json_buf = hack_json_numbers(all_data.buf);
+	json_buf = hack_json_numbers(req->all_data.buf);
 	errno = 0; /* needed for Jansson < 2.1 */
 	val = JSON_LOADS(json_buf, &err);
 	free(json_buf);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
-		goto err_out;
+		goto out;
 	}
 
 	if (opt_protocol) {
@@ -485,33 +597,97 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		applog(LOG_ERR, "JSON-RPC call failed: %s", s);
 
 		free(s);
-
-		goto err_out;
+		json_decref(val);
+		val = NULL;
+		goto out;
 	}
 
-	if (hi.reason)
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
+	if (req->hi.reason)
+		json_object_set_new(val, "reject-reason", json_string(req->hi.reason));
 
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
+out:
+	/* the handle outlives the request: drop its references to it */
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, NULL);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+	free(req->hi.lp_path);
+	free(req->hi.reason);
+	free(req->hi.stratum_url);
+	databuf_free(&req->all_data);
+	curl_slist_free_all(req->headers);
+	free(req);
 	return val;
+}
 
-err_out:
-	free(hi.lp_path);
-	free(hi.reason);
-	free(hi.stratum_url);
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
-	curl_easy_reset(curl);
-	return NULL;
+/*
+ * Hex conversion is done 16 bytes at a time with GCC vector extensions,
+ * which map to SSE2 on x86 and NEON on ARM; the remainder is handled
+ * one byte at a time.  Decoding accepts both cases and fails on any
+ * character that is not a hex digit.
+ */
+#if defined(__clang__) || \
+    (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 7)))
+#define HAVE_HEX_VEC 1
+
+typedef unsigned char hex_vec __attribute__((vector_size(16)));
+
+#ifdef __clang__
+#define hex_shuffle(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define hex_shuffle(a, b, ...) __builtin_shuffle(a, b, (hex_vec){__VA_ARGS__})
+#endif
+
+static inline hex_vec hex_vec_digits(hex_vec n)
+{
+	return n + '0' + ((hex_vec)(n > 9) & ('a' - '0' - 10));
+}
+
+/* Nibble values of the characters in c; bad gets 0xff for the others. */
+static inline hex_vec hex_vec_values(hex_vec c, hex_vec *bad)
+{
+	hex_vec d = c - '0';
+	hex_vec l = (c | 0x20) - 'a';
+	hex_vec is_d = (hex_vec)(d < 10);
+	hex_vec is_l = (hex_vec)(l < 6);
+
+	*bad |= ~(is_d | is_l);
+	return (d & is_d) | ((l + 10) & is_l);
+}
+#endif
+
+static inline int hex_value(unsigned char c)
+{
+	if (c - '0' < 10U)
+		return c - '0';
+	if ((c | 0x20) - 'a' < 6U)
+		return (c | 0x20) - 'a' + 10;
+	return -1;
 }
 
 void bin2hex(char *s, const unsigned char *p, size_t len)
 {
-	int i;
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	static const char digits[] = "0123456789abcdef";
+	size_t i = 0;
+
+#ifdef HAVE_HEX_VEC
+	for (; i + 16 <= len; i += 16) {
+		hex_vec v, hi, lo;
+
+		memcpy(&v, p + i, 16);
+		hi = hex_vec_digits(v >> 4);
+		lo = hex_vec_digits(v & 0x0f);
+		v = hex_shuffle(hi, lo, 0, 16, 1, 17, 2, 18, 3, 19,
+		                        4, 20, 5, 21, 6, 22, 7, 23);
+		memcpy(s + 2 * i, &v, 16);
+		v = hex_shuffle(hi, lo, 8, 24, 9, 25, 10, 26, 11, 27,
+		                        12, 28, 13, 29, 14, 30, 15, 31);
+		memcpy(s + 2 * i + 16, &v, 16);
+	}
+#endif
+	for (; i < len; i++) {
+		s[2 * i] = digits[p[i] >> 4];
+		s[2 * i + 1] = digits[p[i] & 0x0f];
+	}
+	s[2 * len] = '\0';
 }
 
 char *abin2hex(const unsigned char *p, size_t len)
@@ -523,31 +699,70 @@ char *abin2hex(const unsigned char *p, size_t len)
 	return s;
 }
 
-bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+/* Decode exactly 2 * len hex digits; the output may be partly written. */
+static bool hex_decode(unsigned char *p, const char *hexstr, size_t len)
 {
-	char hex_byte[3];
-	char *ep;
+	size_t i = 0;
+
+#ifdef HAVE_HEX_VEC
+	hex_vec bad = {0};
+	uint64_t b[2];
+
+	for (; i + 16 <= len; i += 16) {
+		hex_vec a, c, hi, lo;
+
+		memcpy(&a, hexstr + 2 * i, 16);
+		memcpy(&c, hexstr + 2 * i + 16, 16);
+		hi = hex_shuffle(a, c, 0, 2, 4, 6, 8, 10, 12, 14,
+		                       16, 18, 20, 22, 24, 26, 28, 30);
+		lo = hex_shuffle(a, c, 1, 3, 5, 7, 9, 11, 13, 15,
+		                       17, 19, 21, 23, 25, 27, 29, 31);
+		a = (hex_vec_values(hi, &bad) << 4) | hex_vec_values(lo, &bad);
+		memcpy(p + i, &a, 16);
+	}
+	memcpy(b, &bad, 16);
+	if (b[0] | b[1])
+		return false;
+#endif
+	for (; i < len; i++) {
+		int hi = hex_value(hexstr[2 * i]);
+		int lo = hex_value(hexstr[2 * i + 1]);
+		if ((hi | lo) < 0)
+			return false;
+		p[i] = (hi << 4) | lo;
+	}
+	return true;
+}
 
-	hex_byte[2] = '\0';
+/*
+ * Decode hexlen hex digits, which need not be NUL-terminated, into
+ * hexlen / 2 bytes.
+ */
+bool hex2bin_len(unsigned char *p, const char *hexstr, size_t hexlen)
+{
+	if (hexlen % 2) {
+		applog(LOG_ERR, "hex2bin str truncated");
+		return false;
+	}
+	if (!hex_decode(p, hexstr, hexlen / 2)) {
+		applog(LOG_ERR, "hex2bin failed on invalid digits");
+		return false;
+	}
+	return true;
+}
 
-	while (*hexstr && len) {
-		if (!hexstr[1]) {
-			applog(LOG_ERR, "hex2bin str truncated");
-			return false;
-		}
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-		*p = (unsigned char) strtol(hex_byte, &ep, 16);
-		if (*ep) {
-			applog(LOG_ERR, "hex2bin failed on '%s'", hex_byte);
-			return false;
-		}
-		p++;
-		hexstr += 2;
-		len--;
+bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
+{
+	if (strnlen(hexstr, 2 * len) < 2 * len) {
+		applog(LOG_ERR, "hex2bin str truncated");
+		return false;
+	}
+	if (!hex_decode(p, hexstr, len)) {
+		applog(LOG_ERR, "hex2bin failed on invalid digits");
+		return false;
 	}
 
-	return (len == 0 && *hexstr == 0) ? true : false;
+	return hexstr[2 * len] == '\0';
 }
 
 int varint_encode(unsigned char *p, uint64_t n)
@@ -747,6 +962,33 @@ bool fulltest(const uint32_t *hash, const uint32_t *target)
 	return rc;
 }
 
+/* Return the NUMA node of a CPU, or -1 if the topology is unknown. */
+int cpu_node(int cpu)
+{
+#ifdef __linux__
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	int node = -1;
+
+	sprintf(path, "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir)
+		return -1;
+	while ((ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, "node", 4) &&
+		    ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+#else
+	return -1;
+#endif
+}
+
 void diff_to_target(uint32_t *target, double diff)
 {
 	uint64_t m;
@@ -770,136 +1012,248 @@ void diff_to_target(uint32_t *target, double diff)
 #define socket_blocks() (errno == EAGAIN || errno == EWOULDBLOCK)
 #endif
 
-static bool send_line(curl_socket_t sock, char *s)
-{
-	ssize_t len, sent = 0;
-	
-	len = strlen(s);
-	s[len++] = '\n';
+/*
+ * The Stratum socket is non-blocking.  Outgoing lines are queued in
+ * sendbuf and written as far as the socket allows; whatever is left is
+ * flushed by the Stratum thread when the socket becomes writable, so
+ * that threads submitting shares never wait for the network.  The
+ * Stratum thread waits for both directions at once, using epoll on
+ * Linux and poll() elsewhere; select() and its FD_SETSIZE limit are
+ * only left on Windows, where they do not apply.
+ */
+#define SENDBUF_MAX	(1 << 20)
 
-	while (len > 0) {
-		struct timeval timeout = {0, 0};
-		ssize_t n;
-		fd_set wd;
+#define WAIT_IN		1
+#define WAIT_OUT	2
 
-		FD_ZERO(&wd);
-		FD_SET(sock, &wd);
-		if (select(sock + 1, NULL, &wd, NULL, &timeout) < 1)
-			return false;
-		n = send(sock, s + sent, len, 0);
+/* Write as much queued output as possible; sock_lock must be held. */
+static bool stratum_flush(struct stratum_ctx *sctx)
+{
+	size_t sent = 0;
+
+	while (sent < sctx->sendbuf_len) {
+		ssize_t n = send(sctx->sock, sctx->sendbuf + sent,
+		                 sctx->sendbuf_len - sent, 0);
 		if (n < 0) {
 			if (!socket_blocks())
 				return false;
-			n = 0;
+			break;
 		}
 		sent += n;
-		len -= n;
 	}
+	if (sent) {
+		sctx->sendbuf_len -= sent;
+		memmove(sctx->sendbuf, sctx->sendbuf + sent, sctx->sendbuf_len);
+	}
+#ifdef __linux__
+	if (!!sctx->sendbuf_len != sctx->want_out) {
+		struct epoll_event ev;
 
+		sctx->want_out = !!sctx->sendbuf_len;
+		ev.events = EPOLLIN | (sctx->want_out ? EPOLLOUT : 0);
+		ev.data.u64 = 0;
+		if (epoll_ctl(sctx->epfd, EPOLL_CTL_MOD, sctx->sock, &ev))
+			return false;
+	}
+#endif
 	return true;
 }
 
+/*
+ * Wait up to timeout milliseconds for the socket to become readable,
+ * flushing queued output meanwhile.  Returns 1 if there is something to
+ * read, 0 on timeout and -1 on error.
+ */
+static int stratum_wait(struct stratum_ctx *sctx, int timeout)
+{
+	struct timespec start, now;
+	int elapsed, events;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (elapsed = 0; elapsed <= timeout; ) {
+#if defined(__linux__)
+		struct epoll_event ev[1];
+		int n = epoll_wait(sctx->epfd, ev, 1, timeout - elapsed);
+		if (n < 0 && errno != EINTR)
+			return -1;
+		if (n == 0)
+			return 0;
+		events = 0;
+		if (n > 0) {
+			if (ev[0].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+				events |= WAIT_IN;
+			if (ev[0].events & EPOLLOUT)
+				events |= WAIT_OUT;
+		}
+#elif !defined(WIN32)
+		struct pollfd pfd;
+		int n;
+
+		pfd.fd = sctx->sock;
+		pthread_mutex_lock(&sctx->sock_lock);
+		pfd.events = POLLIN | (sctx->sendbuf_len ? POLLOUT : 0);
+		pthread_mutex_unlock(&sctx->sock_lock);
+		/* wake up now and then to notice output queued meanwhile */
+		n = poll(&pfd, 1, pfd.events & POLLOUT ? timeout - elapsed
+		         : (timeout - elapsed < 100 ? timeout - elapsed : 100));
+		if (n < 0 && errno != EINTR)
+			return -1;
+		events = 0;
+		if (n > 0) {
+			if (pfd.revents & (POLLIN | POLLERR | POLLHUP))
+				events |= WAIT_IN;
+			if (pfd.revents & POLLOUT)
+				events |= WAIT_OUT;
+		}
+#else
+		struct timeval tv = {0, 100000};
+		fd_set rd, wd;
+		int n;
+
+		FD_ZERO(&rd);
+		FD_ZERO(&wd);
+		FD_SET(sctx->sock, &rd);
+		FD_SET(sctx->sock, &wd);
+		pthread_mutex_lock(&sctx->sock_lock);
+		events = sctx->sendbuf_len ? WAIT_OUT : 0;
+		pthread_mutex_unlock(&sctx->sock_lock);
+		n = select(sctx->sock + 1, &rd, events ? &wd : NULL, NULL, &tv);
+		if (n < 0)
+			return -1;
+		events = 0;
+		if (n > 0) {
+			if (FD_ISSET(sctx->sock, &rd))
+				events |= WAIT_IN;
+			if (FD_ISSET(sctx->sock, &wd))
+				events |= WAIT_OUT;
+		}
+#endif
+		if (events & WAIT_OUT) {
+			bool ok;
+			pthread_mutex_lock(&sctx->sock_lock);
+			ok = stratum_flush(sctx);
+			pthread_mutex_unlock(&sctx->sock_lock);
+			if (!ok)
+				return -1;
+		}
+		if (events & WAIT_IN)
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (now.tv_sec - start.tv_sec) * 1000
+		        + (now.tv_nsec - start.tv_nsec) / 1000000;
+	}
+	return 0;
+}
+
 bool stratum_send_line(struct stratum_ctx *sctx, char *s)
 {
+	size_t len;
 	bool ret = false;
 
 	if (opt_protocol)
 		applog(LOG_DEBUG, "> %s", s);
 
+	len = strlen(s);
 	pthread_mutex_lock(&sctx->sock_lock);
-	ret = send_line(sctx->sock, s);
+	if (!sctx->curl || sctx->sendbuf_len + len + 1 > SENDBUF_MAX)
+		goto out;
+	if (sctx->sendbuf_len + len + 1 > sctx->sendbuf_size) {
+		size_t size = 2 * (sctx->sendbuf_len + len + 1);
+		char *buf = realloc(sctx->sendbuf, size);
+		if (!buf)
+			goto out;
+		sctx->sendbuf = buf;
+		sctx->sendbuf_size = size;
+	}
+	memcpy(sctx->sendbuf + sctx->sendbuf_len, s, len);
+	sctx->sendbuf[sctx->sendbuf_len + len] = '\n';
+	sctx->sendbuf_len += len + 1;
+	ret = stratum_flush(sctx);
+out:
 	pthread_mutex_unlock(&sctx->sock_lock);
 
 	return ret;
 }
 
-static bool socket_full(curl_socket_t sock, int timeout)
-{
-	struct timeval tv;
-	fd_set rd;
-
-	FD_ZERO(&rd);
-	FD_SET(sock, &rd);
-	tv.tv_sec = timeout;
-	tv.tv_usec = 0;
-	if (select(sock + 1, &rd, NULL, NULL, &tv) > 0)
-		return true;
-	return false;
-}
-
 bool stratum_socket_full(struct stratum_ctx *sctx, int timeout)
 {
-	return strlen(sctx->sockbuf) || socket_full(sctx->sock, timeout);
+	return sctx->sockbuf_tail > sctx->sockbuf_head ||
+	       stratum_wait(sctx, timeout * 1000) > 0;
 }
 
 #define RBUFSIZE 2048
-#define RECVSIZE (RBUFSIZE - 4)
 
-static void stratum_buffer_append(struct stratum_ctx *sctx, const char *s)
-{
-	size_t old, new;
-
-	old = strlen(sctx->sockbuf);
-	new = old + strlen(s) + 1;
-	if (new >= sctx->sockbuf_size) {
-		sctx->sockbuf_size = new + (RBUFSIZE - (new % RBUFSIZE));
-		sctx->sockbuf = realloc(sctx->sockbuf, sctx->sockbuf_size);
-	}
-	strcpy(sctx->sockbuf + old, s);
-}
-
-char *stratum_recv_line(struct stratum_ctx *sctx)
+/*
+ * Received data is kept between sockbuf_head and sockbuf_tail; the part
+ * before sockbuf_scan is known not to contain a newline, so every byte
+ * is only looked at once.  Lines are returned in place, terminated by
+ * overwriting the newline, and stay valid until the next call.  Unread
+ * data is only moved down when the buffer runs out of room.
+ */
+const char *stratum_recv_line(struct stratum_ctx *sctx, size_t *len)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *nl, *sret = NULL;
+	time_t rstart;
 
-	if (!strstr(sctx->sockbuf, "\n")) {
-		bool ret = true;
-		time_t rstart;
+	time(&rstart);
+	for (;;) {
+		ssize_t n;
 
-		time(&rstart);
-		if (!socket_full(sctx->sock, 60)) {
-			applog(LOG_ERR, "stratum_recv_line timed out");
-			goto out;
+		nl = memchr(sctx->sockbuf + sctx->sockbuf_scan, '\n',
+		            sctx->sockbuf_tail - sctx->sockbuf_scan);
+		if (nl) {
+			/* skip empty lines */
+			if (nl == sctx->sockbuf + sctx->sockbuf_head) {
+				sctx->sockbuf_scan = ++sctx->sockbuf_head;
+				continue;
+			}
+			break;
 		}
-		do {
-			char s[RBUFSIZE];
-			ssize_t n;
-
-			memset(s, 0, RBUFSIZE);
-			n = recv(sctx->sock, s, RECVSIZE, 0);
-			if (!n) {
-				ret = false;
-				break;
+		sctx->sockbuf_scan = sctx->sockbuf_tail;
+
+		if (sctx->sockbuf_tail == sctx->sockbuf_size) {
+			if (sctx->sockbuf_head) {
+				sctx->sockbuf_tail -= sctx->sockbuf_head;
+				memmove(sctx->sockbuf, sctx->sockbuf + sctx->sockbuf_head,
+				        sctx->sockbuf_tail);
+				sctx->sockbuf_scan = sctx->sockbuf_tail;
+				sctx->sockbuf_head = 0;
 			}
-			if (n < 0) {
-				if (!socket_blocks() || !socket_full(sctx->sock, 1)) {
-					ret = false;
-					break;
+			if (sctx->sockbuf_tail > sctx->sockbuf_size / 2) {
+				char *buf = realloc(sctx->sockbuf, 2 * sctx->sockbuf_size);
+				if (!buf) {
+					applog(LOG_ERR, "stratum_recv_line out of memory");
+					goto out;
 				}
-			} else
-				stratum_buffer_append(sctx, s);
-		} while (time(NULL) - rstart < 60 && !strstr(sctx->sockbuf, "\n"));
+				sctx->sockbuf = buf;
+				sctx->sockbuf_size *= 2;
+			}
+		}
 
-		if (!ret) {
+		n = recv(sctx->sock, sctx->sockbuf + sctx->sockbuf_tail,
+		         sctx->sockbuf_size - sctx->sockbuf_tail, 0);
+		if (n > 0) {
+			sctx->sockbuf_tail += n;
+			continue;
+		}
+		if (!n || !socket_blocks()) {
 			applog(LOG_ERR, "stratum_recv_line failed");
 			goto out;
 		}
+		n = 60 - (time(NULL) - rstart);
+		if (n <= 0 || stratum_wait(sctx, n * 1000) <= 0) {
+			applog(LOG_ERR, "stratum_recv_line timed out");
+			goto out;
+		}
 	}
 
-	buflen = strlen(sctx->sockbuf);
-	tok = strtok(sctx->sockbuf, "\n");
-	if (!tok) {
-		applog(LOG_ERR, "stratum_recv_line failed to parse a newline-terminated string");
-		goto out;
-	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	if (buflen > len + 1)
-		memmove(sctx->sockbuf, sctx->sockbuf + len + 1, buflen - len + 1);
-	else
-		sctx->sockbuf[0] = '\0';
+	*nl = '\0';
+	sret = sctx->sockbuf + sctx->sockbuf_head;
+	if (len)
+		*len = nl - sret;
+	sctx->sockbuf_head = sctx->sockbuf_scan = nl + 1 - sctx->sockbuf;
+	if (sctx->sockbuf_head == sctx->sockbuf_tail)
+		sctx->sockbuf_head = sctx->sockbuf_tail = sctx->sockbuf_scan = 0;
 
 out:
 	if (sret && opt_protocol)
@@ -936,7 +1290,8 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 		sctx->sockbuf = calloc(RBUFSIZE, 1);
 		sctx->sockbuf_size = RBUFSIZE;
 	}
-	sctx->sockbuf[0] = '\0';
+	sctx->sockbuf_head = sctx->sockbuf_tail = sctx->sockbuf_scan = 0;
+	sctx->sendbuf_len = 0;
 	pthread_mutex_unlock(&sctx->sock_lock);
 
 	if (url != sctx->url) {
@@ -972,9 +1327,7 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	rc = curl_easy_perform(curl);
 	if (rc) {
 		applog(LOG_ERR, "Stratum connection failed: %s", sctx->curl_err_str);
-		curl_easy_cleanup(curl);
-		sctx->curl = NULL;
-		return false;
+		goto err_out;
 	}
 
 #if LIBCURL_VERSION_NUM < 0x071101
@@ -982,16 +1335,55 @@ bool stratum_connect(struct stratum_ctx *sctx, const char *url)
 	curl_easy_getinfo(curl, CURLINFO_LASTSOCKET, (long *)&sctx->sock);
 #endif
 
+#ifndef WIN32
+	fcntl(sctx->sock, F_SETFL, fcntl(sctx->sock, F_GETFL) | O_NONBLOCK);
+#else
+	{
+		u_long on = 1;
+		ioctlsocket(sctx->sock, FIONBIO, &on);
+	}
+#endif
+#ifdef __linux__
+	{
+		struct epoll_event ev;
+
+		ev.events = EPOLLIN;
+		ev.data.u64 = 0;
+		sctx->want_out = false;
+		sctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (sctx->epfd < 0) {
+			applog(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+			goto err_out;
+		}
+		if (epoll_ctl(sctx->epfd, EPOLL_CTL_ADD, sctx->sock, &ev)) {
+			applog(LOG_ERR, "epoll_ctl failed: %s", strerror(errno));
+			close(sctx->epfd);
+			goto err_out;
+		}
+	}
+#endif
+
 	return true;
+
+err_out:
+	pthread_mutex_lock(&sctx->sock_lock);
+	curl_easy_cleanup(curl);
+	sctx->curl = NULL;
+	pthread_mutex_unlock(&sctx->sock_lock);
+	return false;
 }
 
 void stratum_disconnect(struct stratum_ctx *sctx)
 {
 	pthread_mutex_lock(&sctx->sock_lock);
 	if (sctx->curl) {
+#ifdef __linux__
+		close(sctx->epfd);
+#endif
 		curl_easy_cleanup(sctx->curl);
 		sctx->curl = NULL;
-		sctx->sockbuf[0] = '\0';
+		sctx->sockbuf_head = sctx->sockbuf_tail = sctx->sockbuf_scan = 0;
+		sctx->sendbuf_len = 0;
 	}
 	pthread_mutex_unlock(&sctx->sock_lock);
 }
@@ -1022,8 +1414,8 @@ static const char *get_stratum_session_id(json_t *val)
 
 bool stratum_subscribe(struct stratum_ctx *sctx)
 {
-	char *s, *sret = NULL;
-	const char *sid, *xnonce1;
+	char *s;
+	const char *sret = NULL, *sid, *xnonce1;
 	int xn2_size;
 	json_t *val = NULL, *res_val, *err_val;
 	json_error_t err;
@@ -1043,17 +1435,16 @@ start:
 		goto out;
 	}
 
-	if (!socket_full(sctx->sock, 30)) {
+	if (stratum_wait(sctx, 30 * 1000) <= 0) {
 		applog(LOG_ERR, "stratum_subscribe timed out");
 		goto out;
 	}
 
-	sret = stratum_recv_line(sctx);
+	sret = stratum_recv_line(sctx, NULL);
 	if (!sret)
 		goto out;
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1127,7 +1518,8 @@ out:
 bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *pass)
 {
 	json_t *val = NULL, *res_val, *err_val;
-	char *s, *sret;
+	const char *sret;
+	char *s;
 	json_error_t err;
 	bool ret = false;
 
@@ -1139,16 +1531,14 @@ bool stratum_authorize(struct stratum_ctx *sctx, const char *user, const char *p
 		goto out;
 
 	while (1) {
-		sret = stratum_recv_line(sctx);
+		sret = stratum_recv_line(sctx, NULL);
 		if (!sret)
 			goto out;
 		if (!stratum_handle_method(sctx, sret))
 			break;
-		free(sret);
 	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_ERR, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1173,92 +1563,315 @@ out:
 	return ret;
 }
 
-static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
+/*
+ * A minimal scanner for the Stratum messages that arrive most often.
+ * It only accepts what pools actually send -- strings without escapes,
+ * plain numbers, true, false and null -- and gives up on anything else,
+ * leaving the line to jansson.  Strings are returned as views into the
+ * line, which must be NUL-terminated.
+ */
+struct jscan {
+	const char *p, *end;
+};
+
+static void js_space(struct jscan *js)
+{
+	while (js->p < js->end && (*js->p == ' ' || *js->p == '\t' ||
+	                           *js->p == '\r' || *js->p == '\n'))
+		js->p++;
+}
+
+static bool js_char(struct jscan *js, char c)
+{
+	js_space(js);
+	if (js->p < js->end && *js->p == c) {
+		js->p++;
+		return true;
+	}
+	return false;
+}
+
+static bool js_string(struct jscan *js, const char **str, size_t *len)
+{
+	const char *q;
+
+	if (!js_char(js, '"'))
+		return false;
+	q = memchr(js->p, '"', js->end - js->p);
+	if (!q || memchr(js->p, '\\', q - js->p))
+		return false;
+	*str = js->p;
+	*len = q - js->p;
+	js->p = q + 1;
+	return true;
+}
+
+static bool js_literal(struct jscan *js, const char *lit)
+{
+	size_t n = strlen(lit);
+
+	js_space(js);
+	if ((size_t)(js->end - js->p) < n || memcmp(js->p, lit, n))
+		return false;
+	js->p += n;
+	return true;
+}
+
+static bool js_number(struct jscan *js, double *v)
+{
+	char *ep;
+
+	js_space(js);
+	if (js->p == js->end || !strchr("-0123456789", *js->p))
+		return false;
+	*v = strtod(js->p, &ep);
+	if (ep == js->p || ep > js->end)
+		return false;
+	js->p = ep;
+	return true;
+}
+
+static bool js_skip(struct jscan *js)
+{
+	const char *str;
+	size_t len;
+	double v;
+	int depth = 0;
+
+	js_space(js);
+	if (js->p == js->end)
+		return false;
+	if (*js->p != '[' && *js->p != '{')
+		return js_string(js, &str, &len) || js_number(js, &v) ||
+		       js_literal(js, "true") || js_literal(js, "false") ||
+		       js_literal(js, "null");
+	while (js->p < js->end) {
+		switch (*js->p) {
+		case '"':
+			if (!js_string(js, &str, &len))
+				return false;
+			continue;
+		case '[':
+		case '{':
+			depth++;
+			break;
+		case ']':
+		case '}':
+			if (!--depth) {
+				js->p++;
+				return true;
+			}
+			break;
+		}
+		js->p++;
+	}
+	return false;
+}
+
+/* Skip the remaining elements of an array, and its closing bracket. */
+static bool js_array_end(struct jscan *js)
 {
+	while (js_char(js, ','))
+		if (!js_skip(js))
+			return false;
+	return js_char(js, ']');
+}
+
+struct notify_params {
 	const char *job_id, *prevhash, *coinb1, *coinb2, *version, *nbits, *ntime;
-	size_t coinb1_size, coinb2_size;
-	bool clean, ret = false;
-	int merkle_count, i;
+	size_t job_id_len, coinb1_len, coinb2_len;
+	int merkle_count;
+	json_t *merkle_arr;	/* from jansson, or else */
+	struct jscan merkle;	/* the branches, right after the opening bracket */
+	bool clean;
+};
+
+/*
+ * Decode a validated notification into sctx->job.  Buffers are only
+ * reallocated when they need to grow.
+ */
+static bool stratum_notify_commit(struct stratum_ctx *sctx,
+				  const struct notify_params *np)
+{
+	struct stratum_job *job = &sctx->job;
+	struct jscan js = np->merkle;
+	size_t coinb1_size, coinb2_size, size;
+	bool same_job, ok;
+	int i;
+
+	pthread_mutex_lock(&sctx->work_lock);
+
+	coinb1_size = np->coinb1_len / 2;
+	coinb2_size = np->coinb2_len / 2;
+	size = coinb1_size + sctx->xnonce1_size + sctx->xnonce2_size + coinb2_size;
+	if (size > job->coinbase_alloc) {
+		unsigned char *p = realloc(job->coinbase, size);
+		if (!p)
+			goto err_out;
+		job->coinbase = p;
+		job->coinbase_alloc = size;
+	}
+	if (np->merkle_count > job->merkle_alloc) {
+		unsigned char (*p)[32] = realloc(job->merkle,
+		                                 np->merkle_count * sizeof(*p));
+		if (!p)
+			goto err_out;
+		job->merkle = p;
+		job->merkle_alloc = np->merkle_count;
+	}
+	if (np->job_id_len >= job->job_id_alloc) {
+		char *p = realloc(job->job_id, np->job_id_len + 1);
+		if (!p)
+			goto err_out;
+		job->job_id = p;
+		job->job_id_alloc = np->job_id_len + 1;
+		job->job_id[0] = '\0';
+	}
+
+	same_job = job->coinbase_size &&
+	           strlen(job->job_id) == np->job_id_len &&
+	           !memcmp(job->job_id, np->job_id, np->job_id_len);
+	job->coinbase_size = size;
+	job->xnonce2 = job->coinbase + coinb1_size + sctx->xnonce1_size;
+	ok = hex2bin_len(job->coinbase, np->coinb1, np->coinb1_len);
+	memcpy(job->coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
+	if (!same_job)
+		memset(job->xnonce2, 0, sctx->xnonce2_size);
+	ok = ok && hex2bin_len(job->xnonce2 + sctx->xnonce2_size, np->coinb2,
+	                       np->coinb2_len);
+
+	memcpy(job->job_id, np->job_id, np->job_id_len);
+	job->job_id[np->job_id_len] = '\0';
+	ok = ok && hex2bin_len(job->prevhash, np->prevhash, 64);
+
+	for (i = 0; ok && i < np->merkle_count; i++) {
+		const char *s;
+		size_t len = 64;
+
+		if (np->merkle_arr)
+			s = json_string_value(json_array_get(np->merkle_arr, i));
+		else if ((i && !js_char(&js, ',')) || !js_string(&js, &s, &len))
+			break;	/* cannot happen, it was checked before */
+		ok = hex2bin_len(job->merkle[i], s, len);
+	}
+	job->merkle_count = np->merkle_count;
+
+	ok = ok && hex2bin_len(job->version, np->version, 8) &&
+	     hex2bin_len(job->nbits, np->nbits, 8) &&
+	     hex2bin_len(job->ntime, np->ntime, 8);
+	job->clean = np->clean;
+
+	job->diff = sctx->next_diff;
+
+	if (!ok) {
+		/* no usable job until the next notification */
+		free(job->job_id);
+		job->job_id = NULL;
+		job->job_id_alloc = 0;
+		job->coinbase_size = 0;
+		job->merkle_count = 0;
+		applog(LOG_ERR, "Stratum notify: invalid parameters");
+	}
+
+	pthread_mutex_unlock(&sctx->work_lock);
+	return ok;
+
+err_out:
+	pthread_mutex_unlock(&sctx->work_lock);
+	applog(LOG_ERR, "Stratum notify: out of memory");
+	return false;
+}
+
+static bool stratum_notify(struct stratum_ctx *sctx, json_t *params)
+{
+	struct notify_params np;
 	json_t *merkle_arr;
-	unsigned char **merkle;
+	int i;
 
-	job_id = json_string_value(json_array_get(params, 0));
-	prevhash = json_string_value(json_array_get(params, 1));
-	coinb1 = json_string_value(json_array_get(params, 2));
-	coinb2 = json_string_value(json_array_get(params, 3));
+	memset(&np, 0, sizeof(np));
+	np.job_id = json_string_value(json_array_get(params, 0));
+	np.prevhash = json_string_value(json_array_get(params, 1));
+	np.coinb1 = json_string_value(json_array_get(params, 2));
+	np.coinb2 = json_string_value(json_array_get(params, 3));
 	merkle_arr = json_array_get(params, 4);
 	if (!merkle_arr || !json_is_array(merkle_arr))
-		goto out;
-	merkle_count = json_array_size(merkle_arr);
-	version = json_string_value(json_array_get(params, 5));
-	nbits = json_string_value(json_array_get(params, 6));
-	ntime = json_string_value(json_array_get(params, 7));
-	clean = json_is_true(json_array_get(params, 8));
-
-	if (!job_id || !prevhash || !coinb1 || !coinb2 || !version || !nbits || !ntime ||
-	    strlen(prevhash) != 64 || strlen(version) != 8 ||
-	    strlen(nbits) != 8 || strlen(ntime) != 8) {
+		return false;
+	np.merkle_arr = merkle_arr;
+	np.merkle_count = json_array_size(merkle_arr);
+	np.version = json_string_value(json_array_get(params, 5));
+	np.nbits = json_string_value(json_array_get(params, 6));
+	np.ntime = json_string_value(json_array_get(params, 7));
+	np.clean = json_is_true(json_array_get(params, 8));
+
+	if (!np.job_id || !np.prevhash || !np.coinb1 || !np.coinb2 ||
+	    !np.version || !np.nbits || !np.ntime ||
+	    strlen(np.prevhash) != 64 || strlen(np.version) != 8 ||
+	    strlen(np.nbits) != 8 || strlen(np.ntime) != 8) {
 		applog(LOG_ERR, "Stratum notify: invalid parameters");
-		goto out;
+		return false;
 	}
-	merkle = malloc(merkle_count * sizeof(char *));
-	for (i = 0; i < merkle_count; i++) {
+	for (i = 0; i < np.merkle_count; i++) {
 		const char *s = json_string_value(json_array_get(merkle_arr, i));
 		if (!s || strlen(s) != 64) {
-			while (i--)
-				free(merkle[i]);
-			free(merkle);
 			applog(LOG_ERR, "Stratum notify: invalid Merkle branch");
-			goto out;
+			return false;
 		}
-		merkle[i] = malloc(32);
-		hex2bin(merkle[i], s, 32);
 	}
+	np.job_id_len = strlen(np.job_id);
+	np.coinb1_len = strlen(np.coinb1);
+	np.coinb2_len = strlen(np.coinb2);
 
-	pthread_mutex_lock(&sctx->work_lock);
-
-	coinb1_size = strlen(coinb1) / 2;
-	coinb2_size = strlen(coinb2) / 2;
-	sctx->job.coinbase_size = coinb1_size + sctx->xnonce1_size +
-	                          sctx->xnonce2_size + coinb2_size;
-	sctx->job.coinbase = realloc(sctx->job.coinbase, sctx->job.coinbase_size);
-	sctx->job.xnonce2 = sctx->job.coinbase + coinb1_size + sctx->xnonce1_size;
-	hex2bin(sctx->job.coinbase, coinb1, coinb1_size);
-	memcpy(sctx->job.coinbase + coinb1_size, sctx->xnonce1, sctx->xnonce1_size);
-	if (!sctx->job.job_id || strcmp(sctx->job.job_id, job_id))
-		memset(sctx->job.xnonce2, 0, sctx->xnonce2_size);
-	hex2bin(sctx->job.xnonce2 + sctx->xnonce2_size, coinb2, coinb2_size);
-
-	free(sctx->job.job_id);
-	sctx->job.job_id = strdup(job_id);
-	hex2bin(sctx->job.prevhash, prevhash, 32);
-
-	for (i = 0; i < sctx->job.merkle_count; i++)
-		free(sctx->job.merkle[i]);
-	free(sctx->job.merkle);
-	sctx->job.merkle = merkle;
-	sctx->job.merkle_count = merkle_count;
-
-	hex2bin(sctx->job.version, version, 4);
-	hex2bin(sctx->job.nbits, nbits, 4);
-	hex2bin(sctx->job.ntime, ntime, 4);
-	sctx->job.clean = clean;
-
-	sctx->job.diff = sctx->next_diff;
-
-	pthread_mutex_unlock(&sctx->work_lock);
+	return stratum_notify_commit(sctx, &np);
+}
 
-	ret = true;
+/*
+ * Fast path for mining.notify.  Returns -1 if the parameters are not
+ * exactly what is expected, so that jansson can have a go at them.
+ */
+static int stratum_notify_fast(struct stratum_ctx *sctx, struct jscan *js)
+{
+	struct notify_params np;
+	size_t prevhash_len, version_len, nbits_len, ntime_len, len;
+	const char *s;
+
+	memset(&np, 0, sizeof(np));
+	if (!js_char(js, '[') ||
+	    !js_string(js, &np.job_id, &np.job_id_len) || !js_char(js, ',') ||
+	    !js_string(js, &np.prevhash, &prevhash_len) || !js_char(js, ',') ||
+	    !js_string(js, &np.coinb1, &np.coinb1_len) || !js_char(js, ',') ||
+	    !js_string(js, &np.coinb2, &np.coinb2_len) || !js_char(js, ',') ||
+	    !js_char(js, '['))
+		return -1;
+	np.merkle = *js;
+	if (!js_char(js, ']')) {
+		do {
+			if (!js_string(js, &s, &len) || len != 64)
+				return -1;
+			np.merkle_count++;
+		} while (js_char(js, ','));
+		if (!js_char(js, ']'))
+			return -1;
+	}
+	if (!js_char(js, ',') ||
+	    !js_string(js, &np.version, &version_len) || !js_char(js, ',') ||
+	    !js_string(js, &np.nbits, &nbits_len) || !js_char(js, ',') ||
+	    !js_string(js, &np.ntime, &ntime_len))
+		return -1;
+	if (js_char(js, ',')) {
+		np.clean = js_literal(js, "true");
+		if (!np.clean && !js_skip(js))
+			return -1;
+	}
+	if (!js_array_end(js) ||
+	    prevhash_len != 64 || version_len != 8 || nbits_len != 8 ||
+	    ntime_len != 8)
+		return -1;
 
-out:
-	return ret;
+	return stratum_notify_commit(sctx, &np);
 }
 
-static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+static bool stratum_set_diff(struct stratum_ctx *sctx, double diff)
 {
-	double diff;
-
-	diff = json_number_value(json_array_get(params, 0));
 	if (diff == 0)
 		return false;
 
@@ -1272,6 +1885,60 @@ static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
 	return true;
 }
 
+static bool stratum_set_difficulty(struct stratum_ctx *sctx, json_t *params)
+{
+	return stratum_set_diff(sctx, json_number_value(json_array_get(params, 0)));
+}
+
+/*
+ * Handle mining.notify and mining.set_difficulty without building a
+ * DOM.  Returns -1 if the line is anything else, or not in the expected
+ * shape.
+ */
+static int stratum_handle_method_fast(struct stratum_ctx *sctx,
+				      const char *s, size_t len)
+{
+	struct jscan js = {s, s + len}, params = {NULL, NULL};
+	const char *method = NULL, *key;
+	size_t method_len = 0, key_len;
+	double diff;
+
+	if (!js_char(&js, '{'))
+		return -1;
+	if (!js_char(&js, '}')) {
+		do {
+			if (!js_string(&js, &key, &key_len) || !js_char(&js, ':'))
+				return -1;
+			if (key_len == 6 && !memcmp(key, "method", 6)) {
+				if (!js_string(&js, &method, &method_len))
+					return -1;
+			} else if (key_len == 6 && !memcmp(key, "params", 6)) {
+				js_space(&js);
+				params.p = js.p;
+				if (!js_skip(&js))
+					return -1;
+				params.end = js.p;
+			} else if (!js_skip(&js))
+				return -1;
+		} while (js_char(&js, ','));
+		if (!js_char(&js, '}'))
+			return -1;
+	}
+	if (!method || !params.p)
+		return -1;
+
+	if (method_len == 13 && !strncasecmp(method, "mining.notify", 13))
+		return stratum_notify_fast(sctx, &params);
+	if (method_len == 21 &&
+	    !strncasecmp(method, "mining.set_difficulty", 21)) {
+		if (!js_char(&params, '[') || !js_number(&params, &diff) ||
+		    !js_array_end(&params))
+			return -1;
+		return stratum_set_diff(sctx, diff);
+	}
+	return -1;
+}
+
 static bool stratum_reconnect(struct stratum_ctx *sctx, json_t *params)
 {
 	json_t *port_val;
@@ -1358,6 +2025,11 @@ bool stratum_handle_method(struct stratum_ctx *sctx, const char *s)
 	json_error_t err;
 	const char *method;
 	bool ret = false;
+	int fast;
+
+	fast = stratum_handle_method_fast(sctx, s, strlen(s));
+	if (fast >= 0)
+		return fast;
 
 	val = JSON_LOADS(s, &err);
 	if (!val) {
@@ -1402,45 +2074,88 @@ out:
 struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
+	int i;
 
 	tq = calloc(1, sizeof(*tq));
 	if (!tq)
 		return NULL;
 
-	INIT_LIST_HEAD(&tq->q);
+	for (i = 0; i < TQ_SIZE; i++)
+		tq->cell[i].seq = i;
+#ifndef __linux__
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
+#endif
 
 	return tq;
 }
 
 void tq_free(struct thread_q *tq)
 {
-	struct tq_ent *ent, *iter;
-
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node, struct tq_ent) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
+#ifndef __linux__
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
+#endif
 
 	memset(tq, 0, sizeof(*tq));	/* poison */
 	free(tq);
 }
 
-static void tq_freezethaw(struct thread_q *tq, bool frozen)
+/*
+ * Sleep until the event counter differs from seq.
+ * Return false if abstime has passed.
+ */
+static bool tq_sleep(struct thread_q *tq, int seq,
+	const struct timespec *abstime)
 {
-	pthread_mutex_lock(&tq->mutex);
+	int rc = 0;
 
-	tq->frozen = frozen;
+#ifdef __linux__
+	if (abstime)
+		rc = syscall(SYS_futex, &tq->event,
+		             FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME,
+		             seq, abstime, NULL, FUTEX_BITSET_MATCH_ANY);
+	else
+		rc = syscall(SYS_futex, &tq->event, FUTEX_WAIT | FUTEX_PRIVATE_FLAG,
+		             seq, NULL, NULL, 0);
+	return !(rc && errno == ETIMEDOUT);
+#else
+	pthread_mutex_lock(&tq->mutex);
+	if (__atomic_load_n(&tq->event, __ATOMIC_SEQ_CST) == seq) {
+		if (abstime)
+			rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
+		else
+			rc = pthread_cond_wait(&tq->cond, &tq->mutex);
+	}
+	pthread_mutex_unlock(&tq->mutex);
+	return rc != ETIMEDOUT;
+#endif
+}
 
-	pthread_cond_signal(&tq->cond);
+/* Move the event counter and wake up sleeping consumers, if any. */
+static void tq_wake(struct thread_q *tq)
+{
+	__atomic_add_fetch(&tq->event, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&tq->waiters, __ATOMIC_SEQ_CST))
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, &tq->event, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+	        INT_MAX, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&tq->mutex);
+	pthread_cond_broadcast(&tq->cond);
 	pthread_mutex_unlock(&tq->mutex);
+#endif
+}
+
+static void tq_freezethaw(struct thread_q *tq, bool frozen)
+{
+	__atomic_store_n(&tq->frozen, frozen, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&tq->interrupts, 1, __ATOMIC_SEQ_CST);
+	tq_wake(tq);
 }
 
 void tq_freeze(struct thread_q *tq)
@@ -1455,59 +2170,88 @@ void tq_thaw(struct thread_q *tq)
 
 bool tq_push(struct thread_q *tq, void *data)
 {
-	struct tq_ent *ent;
-	bool rc = true;
-
-	ent = calloc(1, sizeof(*ent));
-	if (!ent)
-		return false;
+	struct tq_cell *cell;
+	unsigned long pos, seq;
+	long dif;
 
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
-
-	pthread_mutex_lock(&tq->mutex);
-
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
+	pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+	for (;;) {
+		if (__atomic_load_n(&tq->frozen, __ATOMIC_ACQUIRE))
+			return false;
+		cell = &tq->cell[pos % TQ_SIZE];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&tq->tail, &pos, pos + 1,
+			                                true, __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			/* full: the consumer is behind, let it catch up */
+			sched_yield();
+			pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
+		} else
+			pos = __atomic_load_n(&tq->tail, __ATOMIC_RELAXED);
 	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-	pthread_cond_signal(&tq->cond);
-	pthread_mutex_unlock(&tq->mutex);
+	tq_wake(tq);
+	return true;
+}
 
-	return rc;
+static bool tq_trypop(struct thread_q *tq, void **data)
+{
+	struct tq_cell *cell;
+	unsigned long pos, seq;
+	long dif;
+
+	pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	for (;;) {
+		cell = &tq->cell[pos % TQ_SIZE];
+		seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		dif = (long)(seq - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&tq->head, &pos, pos + 1,
+			                                true, __ATOMIC_RELAXED,
+			                                __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			if (__atomic_load_n(&tq->tail, __ATOMIC_ACQUIRE) == pos)
+				return false;
+			/* claimed by a producer that has not filled it yet */
+			sched_yield();
+		} else
+			pos = __atomic_load_n(&tq->head, __ATOMIC_RELAXED);
+	}
+	*data = cell->data;
+	__atomic_store_n(&cell->seq, pos + TQ_SIZE, __ATOMIC_RELEASE);
+	return true;
 }
 
+/*
+ * Pop the oldest entry, waiting while the queue is empty.
+ * Return NULL if the queue gets frozen or thawed meanwhile,
+ * or if abstime has passed.
+ */
 void *tq_pop(struct thread_q *tq, const struct timespec *abstime)
 {
-	struct tq_ent *ent;
 	void *rval = NULL;
-	int rc;
-
-	pthread_mutex_lock(&tq->mutex);
-
-	if (!list_empty(&tq->q))
-		goto pop;
-
-	if (abstime)
-		rc = pthread_cond_timedwait(&tq->cond, &tq->mutex, abstime);
-	else
-		rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
-		goto out;
-
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
-
-	list_del(&ent->q_node);
-	free(ent);
+	int seq, interrupts;
+
+	interrupts = __atomic_load_n(&tq->interrupts, __ATOMIC_SEQ_CST);
+	if (tq_trypop(tq, &rval))
+		return rval;
+
+	__atomic_add_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
+	for (;;) {
+		seq = __atomic_load_n(&tq->event, __ATOMIC_SEQ_CST);
+		if (tq_trypop(tq, &rval) ||
+		    __atomic_load_n(&tq->interrupts, __ATOMIC_SEQ_CST) != interrupts ||
+		    !tq_sleep(tq, seq, abstime))
+			break;
+	}
+	__atomic_sub_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
 
-out:
-	pthread_mutex_unlock(&tq->mutex);
 	return rval;
 }